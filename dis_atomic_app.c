@@ -2,12 +2,24 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <cairo.h>
+#include <dirent.h>
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <jpeglib.h>
+#include <limits.h>
+#include <malloc.h>
+#include <math.h>
+#include <png.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
@@ -17,11 +29,132 @@
 #include <sys/reboot.h> /* Definition of LINUX_REBOOT_* constants */
 #include <sys/signalfd.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <signal.h>
 
-#define BOOT_IMAGE_FILE "/etc/boot/boot-01.png"
+/* slide 1 is shown after the countdown, others are selected with CTL_SLIDE */
+#define BOOT_IMAGE_PATTERN "/etc/boot/boot-%02u.%s"
+#define BOOT_IMAGE_FIRST 1
+/* how often a missing first slide shown as the built-in splash is looked for */
+#define STANDIN_RETRY_NS NSEC_PER_SEC
 
-static int cnt_call = 1;
+/* JCS_EXT_BGRX is XRGB8888 in memory on little endian hosts */
+#ifndef JCS_EXTENSIONS
+#error "libjpeg-turbo with JCS_EXTENSIONS is required"
+#endif
+
+#define CONTROL_SOCKET "/run/bootsplash.sock"
+
+#define NSEC_PER_SEC 1000000000ull
+#define NSEC_PER_MSEC 1000000ull
+
+/* seconds of "Please wait" countdown shown before the boot image */
+#define SPLASH_COUNTDOWN 10
+
+/* CLOCK_MONOTONIC time the splash timeline started at */
+static uint64_t splash_start_ns;
+/* and the time the process was started, first pixels are reported against it */
+static uint64_t process_start_ns;
+
+/*
+ * Control protocol, one datagram per command on CONTROL_SOCKET:
+ * a struct ctl_header followed by header.len bytes of payload.
+ *
+ *   CTL_SLIDE     arg = slide number, no payload
+ *   CTL_PROGRESS  arg = 0..100, or CTL_PROGRESS_OFF to hide the bar
+ *   CTL_TEXT      payload = caption in UTF-8, not terminated
+ *   CTL_FRAME     payload = struct ctl_frame, the pixels are in a memfd
+ *                 passed as SCM_RIGHTS; an empty payload drops the frame
+ *   CTL_QUIT      terminate as if SIGTERM was received
+ *   CTL_HANDOFF   the next DRM master is ready: keep the last frame up,
+ *                 drop master and exit once it has taken over
+ */
+enum ctl_cmd
+{
+	CTL_SLIDE = 1,
+	CTL_PROGRESS,
+	CTL_TEXT,
+	CTL_FRAME,
+	CTL_QUIT,
+	CTL_HANDOFF,
+};
+
+#define CTL_PROGRESS_OFF 0xffffffff
+#define CTL_TEXT_MAX 128
+/* no scanout buffer is larger, bigger frames are refused */
+#define CTL_FRAME_DIM_MAX 16384
+
+struct ctl_header
+{
+	uint8_t cmd;
+	uint8_t reserved;
+	uint16_t len;
+	uint32_t arg;
+} __attribute__((packed));
+
+struct ctl_frame
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format;
+	uint64_t offset;
+} __attribute__((packed));
+
+/* what the next frame shows, updated by the control socket */
+struct splash_state
+{
+	unsigned int slide;
+	uint32_t progress;
+	char text[CTL_TEXT_MAX + 1];
+
+	/* frame pushed by a client, mapped read-only from its memfd */
+	uint8_t *frame_map;
+	size_t frame_size;
+	struct ctl_frame frame;
+
+	/* the countdown stops once a client took over */
+	bool controlled;
+};
+
+static struct splash_state splash = {
+	.slide = BOOT_IMAGE_FIRST,
+	.progress = CTL_PROGRESS_OFF,
+};
+
+/*
+ * Raw frames read from a pipe, file or loopback device (-s). Reads go into
+ * the fill buffer; a complete frame is swapped into the ready buffer, which
+ * replaces a ready frame that was never shown. Only the latest frame is
+ * ever drawn, so a slow display never builds up latency.
+ */
+struct stream
+{
+	int fd;
+	bool pollable;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	size_t frame_size;
+
+	uint8_t *fill;
+	uint8_t *ready;
+	size_t filled;
+	bool has_ready;
+	bool ready_shown;
+
+	uint64_t received;
+	uint64_t shown;
+	uint64_t dropped;
+};
+
+static struct stream stream = {
+	.fd = -1,
+	.format = DRM_FORMAT_XRGB8888,
+};
 
 struct drm_object
 {
@@ -30,6 +163,15 @@ struct drm_object
 	uint32_t id;
 };
 
+/*
+ * Framebuffers and slides are split in 64x64 tiles tagged with a hash of
+ * their content, so redraws only write tiles whose tag changes.
+ */
+#define TILE_SIZE 64
+#define TILE_UNKNOWN 0
+#define TILE_BLACK 1
+#define DAMAGE_MAX 32
+
 struct modeset_buf
 {
 	uint32_t width;
@@ -39,8 +181,143 @@ struct modeset_buf
 	uint32_t handle;
 	uint8_t *map;
 	uint32_t fb;
+	uint32_t format;
+
+	/* what each tile holds, TILE_UNKNOWN after anything drew over it */
+	uint64_t *tiles;
+	uint32_t tiles_x, tiles_y;
+
+	/* kept for the buffer's lifetime so drawing a frame allocates nothing */
+	cairo_surface_t *surface;
+	cairo_t *cr;
 };
 
+/* scanout formats we can render, slides are converted once when cached */
+static const struct pixel_format
+{
+	const char *name;
+	uint32_t format;
+	uint32_t bpp;
+	cairo_format_t cairo;
+} pixel_formats[] = {
+	{ "xrgb8888", DRM_FORMAT_XRGB8888, 32, CAIRO_FORMAT_ARGB32 },
+	{ "rgb565", DRM_FORMAT_RGB565, 16, CAIRO_FORMAT_RGB16_565 },
+	{ "xrgb2101010", DRM_FORMAT_XRGB2101010, 32, CAIRO_FORMAT_RGB30 },
+};
+
+#define FORMAT_POLICY_MAX 3
+
+/* preferred formats in order, each device takes the first its plane supports (-F) */
+static uint32_t format_policy[FORMAT_POLICY_MAX] = { DRM_FORMAT_XRGB8888, DRM_FORMAT_RGB565 };
+static unsigned int format_policy_count = 2;
+
+/* framebuffer size in percent of the mode, the plane scales it up (-S) */
+static unsigned int render_scale = 100;
+
+enum background_kind
+{
+	BACKGROUND_NONE,
+	BACKGROUND_SOLID,
+	BACKGROUND_LINEAR,
+	BACKGROUND_RADIAL,
+	BACKGROUND_CYCLE,
+};
+
+/*
+ * Procedural layer under slides and overlays (-b). Colors are XRGB8888,
+ * a linear gradient runs from @from to @to along @angle degrees of the
+ * upright screen, a radial one from the center to the corners, and a
+ * cycle fades a solid color from @from to @to and back every @cycle_ns.
+ */
+static struct
+{
+	enum background_kind kind;
+	uint32_t from;
+	uint32_t to;
+	double angle;
+	uint64_t cycle_ns;
+} background;
+
+/* limits of the -b DEGREES and SECONDS */
+#define BACKGROUND_ANGLE_MAX 360.0
+#define BACKGROUND_CYCLE_MIN 0.1
+#define BACKGROUND_CYCLE_MAX 3600.0
+
+#define ROTATION_MAX 8
+
+/* -R [CONNECTOR:]DEGREES[x][y], connector 0 applies to all others */
+static struct
+{
+	uint32_t connector_id;
+	uint32_t rotation;
+} rotation_settings[ROTATION_MAX];
+static unsigned int rotation_count;
+
+/*
+ * A DRM rotation (reflect, then rotate counter-clockwise) as seen from the
+ * destination: an optional transpose followed by mirroring either axis.
+ */
+struct orient
+{
+	bool transpose;
+	bool flip_x;
+	bool flip_y;
+};
+
+static struct orient orient_get(uint32_t rotation)
+{
+	bool rx = rotation & DRM_MODE_REFLECT_X, ry = rotation & DRM_MODE_REFLECT_Y;
+	struct orient o = { false, rx, ry };
+
+	switch (rotation & DRM_MODE_ROTATE_MASK)
+	{
+	case DRM_MODE_ROTATE_90:
+		o = (struct orient){ true, ry, !rx };
+		break;
+	case DRM_MODE_ROTATE_180:
+		o = (struct orient){ false, !rx, !ry };
+		break;
+	case DRM_MODE_ROTATE_270:
+		o = (struct orient){ true, !ry, rx };
+		break;
+	}
+	return o;
+}
+
+static bool rotation_is_identity(uint32_t rotation)
+{
+	struct orient o = orient_get(rotation);
+
+	return !o.transpose && !o.flip_x && !o.flip_y;
+}
+
+static uint32_t rotation_for_connector(uint32_t connector_id)
+{
+	uint32_t rotation = DRM_MODE_ROTATE_0;
+	unsigned int i;
+
+	for (i = 0; i < rotation_count; i++)
+	{
+		if (rotation_settings[i].connector_id == connector_id)
+			return rotation_settings[i].rotation;
+		if (!rotation_settings[i].connector_id)
+			rotation = rotation_settings[i].rotation;
+	}
+	return rotation;
+}
+
+static const struct pixel_format *pixel_format_get(uint32_t format)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(pixel_formats) / sizeof(pixel_formats[0]); i++)
+	{
+		if (pixel_formats[i].format == format)
+			return &pixel_formats[i];
+	}
+	return &pixel_formats[0];
+}
+
 struct modeset_device
 {
 	struct modeset_device *next;
@@ -54,15 +331,153 @@ struct modeset_device
 	drmModeModeInfo mode;
 	uint32_t mode_blob_id;
 	uint32_t crtc_index;
+	uint32_t format;
+
+	/* requested rotation, done by the plane or by rotating cached slides */
+	uint32_t rotation;
+	uint32_t plane_rotation;
+	uint32_t sw_rotation;
 
 	bool pflip_pending;
 	bool cleanup;
 
-	uint8_t r, g, b;
-	bool r_up, g_up, b_up;
+	/* presentation timing, see modeset_sched_present() */
+	uint64_t frame_ns;
+	uint64_t flip_ns;
+	uint64_t present_ns;
+	uint64_t target_ns;
+	bool target_pending;
+	bool seq_queued;
+
+	unsigned int frames_presented;
+	int64_t max_present_error_ns;
+
+	/* reused for every page flip, and the worst time from wake-up to committed */
+	drmModeAtomicReq *req;
+	uint64_t max_commit_ns;
+
+	/* tiles changed against the front buffer, see modeset_collect_damage() */
+	struct drm_mode_rect damage[DAMAGE_MAX];
+	unsigned int damage_count;
+	/* FB_DAMAGE_CLIPS blob of the last flip, reused while the damage repeats */
+	uint32_t damage_blob;
+	struct drm_mode_rect damage_blob_rects[DAMAGE_MAX];
+	unsigned int damage_blob_count;
+	int last_slide;
+	uint64_t base_written;
+	uint64_t base_full;
+	/* the part of it that switched slides */
+	unsigned int slide_switches;
+	uint64_t switch_written;
+	uint64_t switch_full;
+	uint64_t unpack_bytes;
+	uint64_t unpack_ns;
+
+	/* what the next frame shows, picked by modeset_prepare_frame() */
+	bool draw_due;
+	struct slide *draw_slide;
+	unsigned int draw_frame;
+	unsigned int draw_countdown;
+	bool draw_stream;
+
+	/* animated slide playback, frames are picked for present_ns and judged at their flip */
+	int anim_slide;
+	uint64_t anim_start_ns;
+	uint64_t anim_next_ns;
+	bool anim_pending;
+	uint64_t anim_pending_n;
+	uint64_t anim_pending_due;
+	int64_t anim_shown;
+	unsigned int anim_presented;
+	unsigned int anim_dropped;
+	unsigned int anim_duplicated;
+
+	/* background colors for present_ns and when they change next, see background_at() */
+	uint32_t bg_from;
+	uint32_t bg_to;
+	uint64_t bg_next_ns;
+
+	/* when a stand-in slide is looked for again, 0 with none on screen */
+	uint64_t standin_ns;
+	/* time to first pixel, reported by modeset_page_flip_event() */
+	bool first_slide_pending;
+	bool first_slide_standin;
+	uint64_t first_slide_ns;
+
+	/* handed to the next master at handoff_ns, see modeset_handoff_wait() */
+	uint32_t handoff_fb;
+	bool handoff_kept;
+	uint64_t handoff_ns;
+	uint64_t handoff_black_ns;
+	uint64_t handoff_taken_ns;
+};
+
+/*
+ * One DRM node with KMS outputs. Every card has its own outputs and event
+ * stream on its fd; the single epoll loop serves all of them.
+ */
+struct modeset_card
+{
+	struct modeset_card *next;
+	int fd;
+	char node[PATH_MAX];
+	struct modeset_device *devices;
 };
 
-static struct modeset_device *device_list = NULL;
+static struct modeset_card *card_list = NULL;
+
+/* -H: SIGUSR1 says the next DRM master is ready, like CTL_HANDOFF */
+static bool handoff_on_usr1;
+/* when the next master said it is ready, 0 if it has not */
+static uint64_t handoff_ready_ns;
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * CLOCK_MONOTONIC time the process was started at, from starttime in
+ * /proc/self/stat: clock ticks since boot, so CLOCK_BOOTTIME based.
+ * Falls back to now, which is when main() was entered.
+ */
+static uint64_t get_process_start_ns(void)
+{
+	struct timespec boot;
+	unsigned long long ticks;
+	uint64_t now, start_ns;
+	char buf[1024], *p;
+	long hz;
+	ssize_t len;
+	int fd, field;
+
+	now = get_time_ns();
+	hz = sysconf(_SC_CLK_TCK);
+	fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return now;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0 || hz <= 0)
+		return now;
+	buf[len] = 0;
+
+	/* the command name may hold anything, fields count from after its ')' */
+	p = strrchr(buf, ')');
+	for (field = 2; p && field < 22; field++)
+		p = strchr(p + 1, ' ');
+	if (!p || sscanf(p, "%llu", &ticks) != 1 || clock_gettime(CLOCK_BOOTTIME, &boot))
+		return now;
+
+	start_ns = ticks * (NSEC_PER_SEC / hz);
+	if (start_ns > (uint64_t)boot.tv_sec * NSEC_PER_SEC + boot.tv_nsec)
+		return now;
+	start_ns = (uint64_t)boot.tv_sec * NSEC_PER_SEC + boot.tv_nsec - start_ns;
+	return start_ns < now ? now - start_ns : now;
+}
 
 static int modeset_open(int *out, const char *node)
 {
@@ -81,6 +496,7 @@ static int modeset_open(int *out, const char *node)
 	if (ret)
 	{
 		fprintf(stderr, "failed to set universal planes cap,%d\n", ret);
+		close(fd);
 		return ret;
 	}
 
@@ -88,6 +504,7 @@ static int modeset_open(int *out, const char *node)
 	if (ret)
 	{
 		fprintf(stderr, "failed to set atomic cap,%d\n", ret);
+		close(fd);
 		return ret;
 	}
 
@@ -105,6 +522,10 @@ static int modeset_open(int *out, const char *node)
 		return -ENOTSUP;
 	}
 
+	/* flip and sequence timestamps are compared against get_time_ns() */
+	if (drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) < 0 || !cap)
+		fprintf(stderr, "drm device '%s' has no monotonic timestamps, presentation times will be off\n", node);
+
 	*out = fd;
 	return 0;
 }
@@ -112,7 +533,7 @@ static int modeset_open(int *out, const char *node)
 static int64_t get_property_value(int fd, drmModeObjectPropertiesPtr props, const char *name)
 {
 	drmModePropertyPtr prop;
-	uint64_t value;
+	uint64_t value = 0;
 	bool found;
 	int j;
 
@@ -192,12 +613,25 @@ static int set_drm_object_property(drmModeAtomicReq *req, struct drm_object *obj
 	return drmModeAtomicAddProperty(req, obj->id, prop_id, value);
 }
 
-static int modeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn, struct modeset_device *dev)
+static bool drm_object_has_property(struct drm_object *obj, const char *name)
+{
+	int i;
+
+	for (i = 0; i < obj->props->count_props; i++)
+	{
+		if (!strcmp(obj->props_info[i]->name, name))
+			return true;
+	}
+	return false;
+}
+
+static int modeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn, struct modeset_device *dev,
+							 const struct modeset_device *used)
 {
 	drmModeEncoder *enc;
 	unsigned int i, j;
 	uint32_t crtc;
-	struct modeset_device *iter;
+	const struct modeset_device *iter;
 
 	if (conn->encoder_id)
 		enc = drmModeGetEncoder(fd, conn->encoder_id);
@@ -209,7 +643,7 @@ static int modeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn, st
 		if (enc->crtc_id)
 		{
 			crtc = enc->crtc_id;
-			for (iter = device_list; iter; iter = iter->next)
+			for (iter = used; iter; iter = iter->next)
 			{
 				if (iter->crtc.id == crtc)
 				{
@@ -218,11 +652,16 @@ static int modeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn, st
 				}
 			}
 
-			if (crtc > 0)
+			/* the pipe index picks the vblank source and the planes */
+			for (j = 0; crtc > 0 && j < (unsigned int)res->count_crtcs; ++j)
 			{
-				drmModeFreeEncoder(enc);
-				dev->crtc.id = crtc;
-				return 0;
+				if (res->crtcs[j] == crtc)
+				{
+					drmModeFreeEncoder(enc);
+					dev->crtc.id = crtc;
+					dev->crtc_index = j;
+					return 0;
+				}
 			}
 		}
 
@@ -244,7 +683,7 @@ static int modeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn, st
 				continue;
 
 			crtc = res->crtcs[j];
-			for (iter = device_list; iter; iter = iter->next)
+			for (iter = used; iter; iter = iter->next)
 			{
 				if (iter->crtc.id == crtc)
 				{
@@ -363,18 +802,104 @@ static void modeset_destroy_objects(int fd, struct modeset_device *dev)
 	modeset_drm_object_finish(&dev->plane);
 }
 
+/* does the IN_FORMATS blob list @format with the linear layout dumb buffers have */
+static bool modeset_blob_has_format(const drmModePropertyBlobRes *blob, uint32_t format)
+{
+	const struct drm_format_modifier_blob *hdr = blob->data;
+	const struct drm_format_modifier *mods;
+	const uint32_t *formats;
+	uint32_t i, j;
+
+	if (blob->length < sizeof(*hdr))
+		return false;
+
+	formats = (const uint32_t *)((const uint8_t *)hdr + hdr->formats_offset);
+	mods = (const struct drm_format_modifier *)((const uint8_t *)hdr + hdr->modifiers_offset);
+
+	for (i = 0; i < hdr->count_formats; i++)
+	{
+		if (formats[i] != format)
+			continue;
+
+		for (j = 0; j < hdr->count_modifiers; j++)
+		{
+			if (mods[j].modifier != DRM_FORMAT_MOD_LINEAR)
+				continue;
+			if (i >= mods[j].offset && i < mods[j].offset + 64 &&
+				(mods[j].formats & (1ull << (i - mods[j].offset))))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Pick the scanout format of @dev: the first entry of format_policy the
+ * primary plane accepts, going by its IN_FORMATS blob or, on drivers
+ * without modifier support, the plain format list of the plane.
+ */
+static int modeset_choose_format(int fd, struct modeset_device *dev)
+{
+	drmModePropertyBlobRes *blob = NULL;
+	drmModePlane *plane;
+	int64_t blob_id;
+	unsigned int i, j;
+	bool found = false;
+
+	plane = drmModeGetPlane(fd, dev->plane.id);
+	if (!plane)
+	{
+		fprintf(stderr, "drmModeGetPlane(%u) failed :%s \n", dev->plane.id, strerror(errno));
+		return -ENOENT;
+	}
+
+	blob_id = get_property_value(fd, dev->plane.props, "IN_FORMATS");
+	if (blob_id > 0)
+		blob = drmModeGetPropertyBlob(fd, blob_id);
+
+	for (i = 0; i < format_policy_count && !found; i++)
+	{
+		if (blob)
+		{
+			found = modeset_blob_has_format(blob, format_policy[i]);
+		}
+		else
+		{
+			for (j = 0; j < plane->count_formats && !found; j++)
+				found = plane->formats[j] == format_policy[i];
+		}
+
+		if (found)
+			dev->format = format_policy[i];
+	}
+
+	if (blob)
+		drmModeFreePropertyBlob(blob);
+	drmModeFreePlane(plane);
+
+	if (!found)
+	{
+		fprintf(stderr, "plane %u supports none of the requested formats\n", dev->plane.id);
+		return -EINVAL;
+	}
+
+	fprintf(stdout, "plane %u scans out %s\n", dev->plane.id, pixel_format_get(dev->format)->name);
+	return 0;
+}
+
 static int modeset_create_fb(int fd, struct modeset_buf *buf)
 {
 	struct drm_mode_create_dumb creq;
 	struct drm_mode_destroy_dumb dreq;
 	struct drm_mode_map_dumb mreq;
 	int ret;
-	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0}, i;
 
 	memset(&creq, 0, sizeof(creq));
 	creq.width = buf->width;
 	creq.height = buf->height;
-	creq.bpp = 32;
+	creq.bpp = pixel_format_get(buf->format)->bpp;
 	ret = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
 	if (ret < 0)
 	{
@@ -388,7 +913,7 @@ static int modeset_create_fb(int fd, struct modeset_buf *buf)
 	handles[0] = buf->handle;
 	pitches[0] = buf->stride;
 
-	ret = drmModeAddFB2(fd, buf->width, buf->height, DRM_FORMAT_XRGB8888, handles, pitches, offsets, &buf->fb, 0);
+	ret = drmModeAddFB2(fd, buf->width, buf->height, buf->format, handles, pitches, offsets, &buf->fb, 0);
 
 	if (ret)
 	{
@@ -417,8 +942,25 @@ static int modeset_create_fb(int fd, struct modeset_buf *buf)
 
 	memset(buf->map, 0, buf->size);
 
+	buf->tiles_x = (buf->width + TILE_SIZE - 1) / TILE_SIZE;
+	buf->tiles_y = (buf->height + TILE_SIZE - 1) / TILE_SIZE;
+	buf->tiles = malloc(sizeof(*buf->tiles) * buf->tiles_x * buf->tiles_y);
+	if (!buf->tiles)
+	{
+		ret = -ENOMEM;
+		goto err_unmap;
+	}
+	for (i = 0; i < buf->tiles_x * buf->tiles_y; i++)
+		buf->tiles[i] = TILE_BLACK;
+
+	buf->surface = cairo_image_surface_create_for_data(buf->map, pixel_format_get(buf->format)->cairo,
+													   buf->width, buf->height, buf->stride);
+	buf->cr = cairo_create(buf->surface);
+
 	return 0;
 
+err_unmap:
+	munmap(buf->map, buf->size);
 err_fb:
 	drmModeRmFB(fd, buf->fb);
 err_destroy:
@@ -428,25 +970,88 @@ err_destroy:
 	return ret;
 }
 
-static void modeset_destroy_fb(int fd, struct modeset_buf *buf)
+/* free everything of @buf but the framebuffer, which may stay on screen */
+static void modeset_release_fb(int fd, struct modeset_buf *buf)
 {
 	struct drm_mode_destroy_dumb dreq;
 
-	munmap(buf->map, buf->size);
-	drmModeRmFB(fd, buf->fb);
-	memset(&dreq, 0, sizeof(dreq));
-	dreq.handle = buf->handle;
-	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+	if (buf->cr)
+		cairo_destroy(buf->cr);
+	if (buf->surface)
+		cairo_surface_destroy(buf->surface);
+	free(buf->tiles);
+	if (buf->map)
+		munmap(buf->map, buf->size);
+	/* the framebuffer holds its own reference to the memory */
+	if (buf->handle)
+	{
+		memset(&dreq, 0, sizeof(dreq));
+		dreq.handle = buf->handle;
+		drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+	}
+	buf->cr = NULL;
+	buf->surface = NULL;
+	buf->tiles = NULL;
+	buf->map = NULL;
+	buf->handle = 0;
+}
+
+static void modeset_destroy_fb(int fd, struct modeset_buf *buf)
+{
+	modeset_release_fb(fd, buf);
+	if (buf->fb)
+		drmModeRmFB(fd, buf->fb);
+	buf->fb = 0;
+}
+
+/*
+ * Let go of a framebuffer that may still be scanned out. CLOSEFB (Linux
+ * 6.8) leaves it up until the next master commits over it. Returns false
+ * without it: then RMFB, and closing the fd, which exiting does anyway,
+ * turn the plane off.
+ */
+static bool modeset_close_fb(int fd, struct modeset_buf *buf)
+{
+#ifdef DRM_IOCTL_MODE_CLOSEFB
+	struct drm_mode_closefb cfb;
+
+	memset(&cfb, 0, sizeof(cfb));
+	cfb.fb_id = buf->fb;
+	if (buf->fb && drmIoctl(fd, DRM_IOCTL_MODE_CLOSEFB, &cfb) == 0)
+	{
+		buf->fb = 0;
+		return true;
+	}
+#endif
+	return false;
 }
 
-static int modeset_setup_framebuffer(int fd, drmModeConnector *conn, struct modeset_device *dev)
+static int modeset_setup_framebuffer(int fd, drmModeConnector *conn, struct modeset_device *dev, unsigned int scale)
 {
 	int i, ret;
 
 	for (i = 0; i < 2; i++)
 	{
-		dev->bufs[i].width = conn->modes[0].hdisplay;
-		dev->bufs[i].height = conn->modes[0].vdisplay;
+		/* the plane rotates the framebuffer, so it has the rotated size */
+		if (orient_get(dev->plane_rotation).transpose)
+		{
+			dev->bufs[i].width = conn->modes[0].vdisplay;
+			dev->bufs[i].height = conn->modes[0].hdisplay;
+		}
+		else
+		{
+			dev->bufs[i].width = conn->modes[0].hdisplay;
+			dev->bufs[i].height = conn->modes[0].vdisplay;
+		}
+		if (scale != 100)
+		{
+			/* even sizes keep 2x2 subsampled streams aligned */
+			dev->bufs[i].width = (dev->bufs[i].width * scale / 100) & ~1u;
+			dev->bufs[i].height = (dev->bufs[i].height * scale / 100) & ~1u;
+		}
+		if (!dev->bufs[i].width || !dev->bufs[i].height)
+			return -EINVAL;
+		dev->bufs[i].format = dev->format;
 
 		ret = modeset_create_fb(fd, &dev->bufs[i]);
 		if (ret)
@@ -462,19 +1067,136 @@ static int modeset_setup_framebuffer(int fd, drmModeConnector *conn, struct mode
 	return 0;
 }
 
+static int modeset_atomic_prepare_commit(int fd, struct modeset_device *dev, drmModeAtomicReq *req)
+{
+	struct drm_object *plane = &dev->plane;
+	struct modeset_buf *buf = &dev->bufs[dev->front_buf ^ 1];
+
+	if (set_drm_object_property(req, &dev->connector, "CRTC_ID", dev->crtc.id) < 0)
+		return -1;
+
+	if (set_drm_object_property(req, &dev->crtc, "MODE_ID", dev->mode_blob_id) < 0)
+		return -1;
+
+	if (set_drm_object_property(req, &dev->crtc, "ACTIVE", 1) < 0)
+		return -1;
+
+	if (set_drm_object_property(req, plane, "FB_ID", buf->fb) < 0)
+		return -1;
+
+	if (set_drm_object_property(req, plane, "CRTC_ID", dev->crtc.id) < 0)
+		return -1;
+
+	if (set_drm_object_property(req, plane, "SRC_X", 0) < 0)
+		return -1;
+
+	if (set_drm_object_property(req, plane, "SRC_Y", 0) < 0)
+		return -1;
+
+	if (set_drm_object_property(req, plane, "SRC_W", buf->width << 16) < 0)
+		return -1;
+
+	if (set_drm_object_property(req, plane, "SRC_H", buf->height << 16) < 0)
+		return -1;
+
+	if (set_drm_object_property(req, plane, "CRTC_X", 0) < 0)
+		return -1;
+
+	if (set_drm_object_property(req, plane, "CRTC_Y", 0) < 0)
+		return -1;
+
+	/* with a render scale below 100 the plane upscales the framebuffer */
+	if (set_drm_object_property(req, plane, "CRTC_W", dev->mode.hdisplay) < 0)
+		return -1;
+
+	if (set_drm_object_property(req, plane, "CRTC_H", dev->mode.vdisplay) < 0)
+		return -1;
+
+	/* always set when present, a previous client may have left it rotated */
+	if (drm_object_has_property(plane, "rotation") &&
+		set_drm_object_property(req, plane, "rotation", dev->plane_rotation) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Many planes cannot scale or rotate at all or only by some factors, so
+ * a setup is checked with a TEST_ONLY commit of this device alone.
+ */
+static int modeset_test_commit(int fd, struct modeset_device *dev)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	ret = modeset_atomic_prepare_commit(fd, dev, req);
+	if (ret >= 0)
+		ret = drmModeAtomicCommit(fd, req, DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	drmModeAtomicFree(req);
+
+	return ret < 0 ? -errno : 0;
+}
+
+/*
+ * Framebuffers for the best setup the plane accepts: plane rotation and
+ * scaling, then software rotation with plane scaling, then neither.
+ */
+static int modeset_setup_output(int fd, drmModeConnector *conn, struct modeset_device *dev)
+{
+	unsigned int attempt, scale;
+	bool plane_rotate;
+	int ret;
+
+	for (attempt = 0; attempt < 3; attempt++)
+	{
+		plane_rotate = attempt == 0;
+		scale = attempt == 2 ? 100 : render_scale;
+		if (plane_rotate && (dev->rotation == DRM_MODE_ROTATE_0 || !drm_object_has_property(&dev->plane, "rotation")))
+			continue;
+
+		dev->plane_rotation = plane_rotate ? dev->rotation : DRM_MODE_ROTATE_0;
+		dev->sw_rotation = plane_rotate ? DRM_MODE_ROTATE_0 : dev->rotation;
+		ret = modeset_setup_framebuffer(fd, conn, dev, scale);
+		if (ret)
+			return ret;
+
+		/* the unrotated full size setup is what the modeset test checks */
+		if ((!plane_rotate && scale == 100) || !modeset_test_commit(fd, dev))
+			return 0;
+
+		fprintf(stderr, "plane %u rejects %ux%u to %ux%u%s\n", dev->plane.id, dev->bufs[0].width, dev->bufs[0].height,
+				dev->mode.hdisplay, dev->mode.vdisplay, plane_rotate ? " rotated" : "");
+		modeset_destroy_fb(fd, &dev->bufs[0]);
+		modeset_destroy_fb(fd, &dev->bufs[1]);
+	}
+
+	return -EINVAL;
+}
+
 static void modeset_device_destory(int fd, struct modeset_device *dev)
 {
 	modeset_destroy_objects(fd, dev);
 
+	/* not removed while it may still be up, closing the fd at exit ends it soon enough */
+	if (dev->handoff_ns && !dev->handoff_kept && !dev->handoff_taken_ns)
+		dev->bufs[dev->front_buf].fb = 0;
 	modeset_destroy_fb(fd, &dev->bufs[0]);
 	modeset_destroy_fb(fd, &dev->bufs[1]);
 
 	drmModeDestroyPropertyBlob(fd, dev->mode_blob_id);
+	if (dev->damage_blob)
+		drmModeDestroyPropertyBlob(fd, dev->damage_blob);
+	drmModeAtomicFree(dev->req);
 
 	free(dev);
 }
 
-static struct modeset_device *modeset_device_create(int fd, drmModeRes *res, drmModeConnector *conn)
+static struct modeset_device *modeset_device_create(int fd, drmModeRes *res, drmModeConnector *conn,
+													const struct modeset_device *used)
 {
 	int ret;
 	struct modeset_device *dev;
@@ -482,6 +1204,8 @@ static struct modeset_device *modeset_device_create(int fd, drmModeRes *res, drm
 	dev = malloc(sizeof(*dev));
 	memset(dev, 0, sizeof(*dev));
 	dev->connector.id = conn->connector_id;
+	dev->last_slide = -1;
+	dev->anim_slide = -1;
 
 	if (conn->connection != DRM_MODE_CONNECTED)
 	{
@@ -496,13 +1220,17 @@ static struct modeset_device *modeset_device_create(int fd, drmModeRes *res, drm
 	}
 
 	memcpy(&dev->mode, &conn->modes[0], sizeof(dev->mode));
+	if (dev->mode.clock && dev->mode.htotal && dev->mode.vtotal)
+		dev->frame_ns = (uint64_t)dev->mode.htotal * dev->mode.vtotal * 1000000 / dev->mode.clock;
+	else
+		dev->frame_ns = NSEC_PER_SEC / 60;
 	if (drmModeCreatePropertyBlob(fd, &dev->mode, sizeof(dev->mode), &dev->mode_blob_id) != 0)
 	{
 		fprintf(stderr, "couldn't create a blob property\n");
 		goto dev_error;
 	}
 
-	ret = modeset_find_crtc(fd, res, conn, dev);
+	ret = modeset_find_crtc(fd, res, conn, dev, used);
 	if (ret)
 	{
 		fprintf(stderr, "no valid crtc for connector %u\n", conn->connector_id);
@@ -520,20 +1248,35 @@ static struct modeset_device *modeset_device_create(int fd, drmModeRes *res, drm
 	if (ret)
 	{
 		fprintf(stderr, "cannnot get properties \n");
-		goto dev_obj;
+		goto dev_blob;
 	}
 
-	ret = modeset_setup_framebuffer(fd, conn, dev);
+	ret = modeset_choose_format(fd, dev);
+	if (ret)
+		goto dev_obj;
+
+	dev->rotation = rotation_for_connector(conn->connector_id);
+	ret = modeset_setup_output(fd, conn, dev);
 	if (ret)
 	{
 		fprintf(stderr, "connot create framebuffers for connector %u\n", conn->connector_id);
 		goto dev_obj;
 	}
 
-	fprintf(stderr, "mode for connector %u is %ux%u\n", conn->connector_id, dev->bufs[0].width, dev->bufs[0].height);
-	return dev;
-
-dev_obj:
+	dev->req = drmModeAtomicAlloc();
+	if (!dev->req)
+	{
+		modeset_destroy_fb(fd, &dev->bufs[0]);
+		modeset_destroy_fb(fd, &dev->bufs[1]);
+		goto dev_obj;
+	}
+
+	fprintf(stderr, "mode for connector %u is %ux%u, rendering at %ux%u, rotation 0x%x by %s\n", conn->connector_id,
+			dev->mode.hdisplay, dev->mode.vdisplay, dev->bufs[0].width, dev->bufs[0].height, dev->rotation,
+			dev->sw_rotation != DRM_MODE_ROTATE_0 ? "software" : "plane");
+	return dev;
+
+dev_obj:
 	modeset_destroy_objects(fd, dev);
 dev_blob:
 	drmModeDestroyPropertyBlob(fd, dev->mode_blob_id);
@@ -542,12 +1285,13 @@ dev_error:
 	return NULL;
 }
 
-static int modeset_prepare(int fd)
+static int modeset_prepare(struct modeset_card *card)
 {
 	drmModeRes *res;
 	drmModeConnector *conn;
 	unsigned int i;
 	struct modeset_device *dev;
+	int fd = card->fd;
 
 	res = drmModeGetResources(fd);
 	if (!res)
@@ -565,478 +1309,6182 @@ static int modeset_prepare(int fd)
 			continue;
 		}
 
-		dev = modeset_device_create(fd, res, conn);
+		dev = modeset_device_create(fd, res, conn, card->devices);
 		drmModeFreeConnector(conn);
 		if (!dev)
 			continue;
 
-		dev->next = device_list;
-		device_list = dev;
+		dev->next = card->devices;
+		card->devices = dev;
 	}
-	if (!device_list)
+
+	drmModeFreeResources(res);
+	if (!card->devices)
 	{
-		fprintf(stderr, "couldn't create any devices\n");
+		fprintf(stderr, "couldn't create any devices on '%s'\n", card->node);
 		return -1;
 	}
-
-	drmModeFreeResources(res);
 	return 0;
 }
 
-static int modeset_atomic_prepare_commit(int fd, struct modeset_device *dev, drmModeAtomicReq *req)
+/* card0, card1, ... but not the render nodes */
+static int card_filter(const struct dirent *entry)
 {
-	struct drm_object *plane = &dev->plane;
-	struct modeset_buf *buf = &dev->bufs[dev->front_buf ^ 1];
+	return !strncmp(entry->d_name, "card", 4);
+}
 
-	if (set_drm_object_property(req, &dev->connector, "CRTC_ID", dev->crtc.id) < 0)
-		return -1;
+/*
+ * Open @node, or every /dev/dri/card* when it is NULL, keeping the cards
+ * that have at least one output to drive.
+ */
+static int modeset_open_cards(const char *node)
+{
+	struct modeset_card *card, **tail = &card_list;
+	struct dirent **names = NULL;
+	int count, i;
 
-	if (set_drm_object_property(req, &dev->crtc, "MODE_ID", dev->mode_blob_id) < 0)
-		return -1;
+	if (node)
+		count = 1;
+	else
+	{
+		count = scandir("/dev/dri", &names, card_filter, versionsort);
+		if (count < 0)
+		{
+			fprintf(stderr, "cannot list /dev/dri (%d):%m\n", errno);
+			return -errno;
+		}
+	}
 
-	if (set_drm_object_property(req, &dev->crtc, "ACTIVE", 1) < 0)
-		return -1;
+	for (i = 0; i < count; i++)
+	{
+		card = calloc(1, sizeof(*card));
+		if (!card)
+			break;
+		if (node)
+			snprintf(card->node, sizeof(card->node), "%s", node);
+		else
+			snprintf(card->node, sizeof(card->node), "/dev/dri/%s", names[i]->d_name);
 
-	if (set_drm_object_property(req, plane, "FB_ID", buf->fb) < 0)
-		return -1;
+		fprintf(stderr, "using card '%s'\n", card->node);
+		if (modeset_open(&card->fd, card->node))
+		{
+			free(card);
+			continue;
+		}
+		if (modeset_prepare(card))
+		{
+			close(card->fd);
+			free(card);
+			continue;
+		}
 
-	if (set_drm_object_property(req, plane, "CRTC_ID", dev->crtc.id) < 0)
-		return -1;
+		*tail = card;
+		tail = &card->next;
+	}
 
-	if (set_drm_object_property(req, plane, "SRC_X", 0) < 0)
-		return -1;
+	for (i = 0; names && i < count; i++)
+		free(names[i]);
+	free(names);
 
-	if (set_drm_object_property(req, plane, "SRC_Y", 0) < 0)
-		return -1;
+	if (!card_list)
+	{
+		fprintf(stderr, "no card with a usable output\n");
+		return -ENODEV;
+	}
+	return 0;
+}
 
-	if (set_drm_object_property(req, plane, "SRC_W", buf->width << 16) < 0)
-		return -1;
+/*
+ * Colors of the background at @when, returns when they change next or 0
+ * if they never do. A cycle moves linearly there and back, so it is
+ * redrawn about as often as one of its channels steps.
+ */
+static uint64_t background_at(uint64_t when, uint32_t *from, uint32_t *to)
+{
+	uint64_t half, phase, step;
+	uint32_t pos, delta = 1, c, f, t;
+	int shift;
+
+	*from = background.from;
+	*to = background.to;
+	if (background.kind != BACKGROUND_CYCLE)
+		return 0;
+
+	half = background.cycle_ns / 2;
+	phase = (when > splash_start_ns ? when - splash_start_ns : 0) % background.cycle_ns;
+	pos = (phase < half ? phase : background.cycle_ns - phase) * 65536 / half;
+	for (shift = 0, c = 0; shift <= 16; shift += 8)
+	{
+		f = (background.from >> shift) & 0xff;
+		t = (background.to >> shift) & 0xff;
+		c |= (uint32_t)(f + (((int)t - (int)f) * (int)pos >> 16)) << shift;
+		delta = abs((int)t - (int)f) > (int)delta ? abs((int)t - (int)f) : delta;
+	}
+	*from = *to = c;
 
-	if (set_drm_object_property(req, plane, "SRC_H", buf->height << 16) < 0)
-		return -1;
+	step = half / delta;
+	return when + (step ? step : 1);
+}
 
-	if (set_drm_object_property(req, plane, "CRTC_X", 0) < 0)
-		return -1;
+/* seconds of countdown still to show at @when, 0 once the boot image is up */
+static unsigned int splash_countdown_at(uint64_t when)
+{
+	uint64_t elapsed;
 
-	if (set_drm_object_property(req, plane, "CRTC_Y", 0) < 0)
-		return -1;
+	if (splash.controlled)
+		return 0;
 
-	if (set_drm_object_property(req, plane, "CRTC_W", buf->width) < 0)
-		return -1;
+	elapsed = when > splash_start_ns ? (when - splash_start_ns) / NSEC_PER_SEC : 0;
+	if (elapsed >= SPLASH_COUNTDOWN - 1)
+		return 0;
+	return SPLASH_COUNTDOWN - 1 - elapsed;
+}
 
-	if (set_drm_object_property(req, plane, "CRTC_H", buf->height) < 0)
-		return -1;
+/* time the splash content changes next after @when, 0 if it stays static */
+static uint64_t splash_next_change(uint64_t when)
+{
+	uint64_t elapsed;
 
-	return 0;
+	if (!splash_countdown_at(when))
+		return 0;
+
+	elapsed = when > splash_start_ns ? (when - splash_start_ns) / NSEC_PER_SEC : 0;
+	return splash_start_ns + (elapsed + 1) * NSEC_PER_SEC;
 }
 
-#if 0
-static uint8_t next_color(bool *up, uint8_t cur, unsigned int mod)
+/* forget the peak RSS so far, see clear_refs in proc(5) */
+static void rss_reset_peak(void)
 {
-	uint8_t next;
+	int fd;
 
-	next = cur + (*up ? 1 : -1) * (rand() % mod);
-	if ((*up && next < cur) || (!*up && next > cur))
-	{
-		*up = !*up;
-		next = cur;
-	}
-
-	return next;
+	fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (write(fd, "5", 1) < 0)
+		fprintf(stderr, "cannot reset peak RSS (%d):%m\n", errno);
+	close(fd);
 }
-#endif
 
-static void modeset_draw_framebuffer(struct modeset_device *dev)
+/* @key from /proc/self/status in kB, e.g. "VmRSS:" or "VmHWM:" */
+static long rss_read_kb(const char *key)
 {
-	struct modeset_buf *buf;
-	unsigned int j, k, off;
-	char time_left[5];
-	cairo_t *cr;
-	cairo_surface_t *surface, *image;
+	char line[128];
+	long kb = -1;
+	FILE *fp;
 
-	cairo_text_extents_t te;
+	fp = fopen("/proc/self/status", "r");
+	if (!fp)
+		return -1;
 
-	buf = &dev->bufs[dev->front_buf ^ 1];
-	for (j = 0; j < buf->height; ++j)
+	while (fgets(line, sizeof(line), fp))
 	{
-		for (k = 0; k < buf->width; ++k)
+		if (!strncmp(line, key, strlen(key)))
 		{
-			off = buf->stride * j + k * 4;
-			*(uint32_t *)&buf->map[off] = (0 << 16) | (0 << 8) | 0;
+			kb = strtol(line + strlen(key), NULL, 10);
+			break;
 		}
 	}
 
-	image = cairo_image_surface_create_from_png(BOOT_IMAGE_FILE);
-	surface = cairo_image_surface_create_for_data(buf->map, CAIRO_FORMAT_ARGB32,
-												  buf->width, buf->height, buf->stride);
-	cr = cairo_create(surface);
-	cairo_set_source_rgb(cr, 255.0, 255.0, 255.0);
-	cairo_select_font_face(cr, "Georgia",
-			CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
-	cairo_set_font_size(cr, 100);
+	fclose(fp);
+	return kb;
+}
 
-	if (cnt_call <= 1)
-	{
-		//	itoa(cnt_call,time_left,10);
-		sprintf(time_left, "%d", 10 - cnt_call);
+/* stack the main loop may touch, faulted in up front in real-time mode */
+#define RT_STACK_PREFAULT (256 << 10)
+/* memory each stress worker keeps dirtying */
+#define STRESS_VM_SIZE (64 << 20)
+#define STRESS_MAX 32
 
-		cairo_text_extents(cr, "a", &te);
-		cairo_move_to(cr, 350, buf->height / 2);
-		cairo_show_text(cr, "Please wait, staring CarIOS...");
-		cairo_text_extents(cr, "a", &te);
-		cairo_move_to(cr, buf->width / 2, buf->height / 2 + 150);
-		cairo_show_text(cr, time_left);
-		cnt_call++;
-	}
-	else
-	{
-		cairo_set_source_surface(cr, image, 0, 0);
-		cairo_paint(cr);
-	}
+/* SCHED_FIFO priority of the event loop, 0 runs it as a normal task */
+static int rt_priority;
+static pid_t stress_pids[STRESS_MAX];
+static unsigned int stress_count;
+
+static void rt_prefault_stack(void)
+{
+	volatile uint8_t stack[RT_STACK_PREFAULT];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
 }
 
-static void modeset_draw_output(int fd, struct modeset_device *dev)
+/*
+ * Real-time mode: everything mapped now or later (text, heap, framebuffers,
+ * slide cache) is faulted in and locked, freed heap stays mapped for reuse
+ * and the event loop, which also commits, runs at SCHED_FIFO @prio.
+ * Failures are reported and the splash runs anyway.
+ */
+static void realtime_enter(int prio)
 {
-	drmModeAtomicReq *req;
-	int ret, flags;
+	struct sched_param sp = { .sched_priority = prio };
 
-	modeset_draw_framebuffer(dev);
-	req = drmModeAtomicAlloc();
-	ret = modeset_atomic_prepare_commit(fd, dev, req);
-	if (ret < 0)
-	{
-		fprintf(stderr, "prepare atomic commit failed, %d \n", errno);
-		return;
-	}
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		fprintf(stderr, "cannot lock memory (%d):%m\n", errno);
+	rt_prefault_stack();
 
-	flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
-	ret = drmModeAtomicCommit(fd, req, flags, NULL);
-	drmModeAtomicFree(req);
+	if (sched_setscheduler(0, SCHED_FIFO, &sp))
+		fprintf(stderr, "cannot switch to SCHED_FIFO %d (%d):%m\n", prio, errno);
+	else
+		fprintf(stderr, "real-time mode, SCHED_FIFO priority %d\n", prio);
+}
 
-	if (ret < 0)
-	{
-		fprintf(stderr, "atomic commit failed ,%d\n", errno);
-		return;
-	}
+/* page faults taken so far */
+static void rt_faults(long *major, long *minor)
+{
+	struct rusage ru;
 
-	dev->front_buf ^= 1;
-	dev->pflip_pending = true;
+	getrusage(RUSAGE_SELF, &ru);
+	*major = ru.ru_majflt;
+	*minor = ru.ru_minflt;
 }
 
-static void modeset_page_flip_event(int fd, unsigned int frame, unsigned int sec, unsigned int usec, unsigned int crtc_id, void *data)
+/*
+ * Start @count workers in the style of stress(1), alternating a CPU
+ * spinner and a worker dirtying STRESS_VM_SIZE and giving it back, to
+ * measure commit latency under boot-time contention.
+ */
+static void stress_start(unsigned int count)
 {
-	struct modeset_device *dev, *iter;
+	volatile uint64_t spin = 0;
+	sigset_t none;
+	uint8_t *vm;
+	pid_t pid;
 
-	dev = NULL;
-	for (iter = device_list; iter; iter = iter->next)
+	for (stress_count = 0; stress_count < count && stress_count < STRESS_MAX; stress_count++)
 	{
-		if (iter->crtc.id == crtc_id)
+		pid = fork();
+		if (pid < 0)
 		{
-			dev = iter;
+			fprintf(stderr, "cannot start stress worker (%d):%m\n", errno);
 			break;
 		}
-	}
+		if (pid > 0)
+		{
+			stress_pids[stress_count] = pid;
+			continue;
+		}
 
-	if (dev == NULL)
-		return;
+		/* workers are ordinary tasks that die with the splash */
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		munlockall();
+		if (rt_priority)
+			sched_setscheduler(0, SCHED_OTHER, &(struct sched_param){ 0 });
 
-	dev->pflip_pending = false;
-	if (!dev->cleanup)
-		modeset_draw_output(fd, dev);
+		for (;;)
+		{
+			if (!(stress_count & 1))
+			{
+				spin++;
+				continue;
+			}
+			vm = mmap(NULL, STRESS_VM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (vm == MAP_FAILED)
+				continue;
+			memset(vm, spin++, STRESS_VM_SIZE);
+			munmap(vm, STRESS_VM_SIZE);
+		}
+	}
+
+	if (stress_count)
+		fprintf(stderr, "started %u stress workers\n", stress_count);
 }
 
-static int modeset_perform_modeset(int fd)
+static void stress_stop(void)
 {
-	int ret, flags;
-	struct modeset_device *iter;
-	drmModeAtomicReq *req;
+	unsigned int i;
 
-	req = drmModeAtomicAlloc();
-	for (iter = device_list; iter; iter = iter->next)
+	for (i = 0; i < stress_count; i++)
 	{
-		ret = modeset_atomic_prepare_commit(fd, iter, req);
-		if (ret < 0)
-			break;
+		kill(stress_pids[i], SIGKILL);
+		waitpid(stress_pids[i], NULL, 0);
 	}
+	stress_count = 0;
+}
 
-	if (ret < 0)
-	{
-		fprintf(stderr, "prepare atomic commit failed,%d\n", errno);
-		return ret;
-	}
+/* GCC vector extensions for the pixel kernels */
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef int32_t v16si __attribute__((vector_size(64)));
+typedef uint8_t v16qu __attribute__((vector_size(16)));
+typedef uint32_t v4su __attribute__((vector_size(16)));
+typedef uint16_t v4hu __attribute__((vector_size(8)));
+typedef float v4sf __attribute__((vector_size(16)));
 
-	flags = DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET;
-	ret = drmModeAtomicCommit(fd, req, flags, NULL);
-	if (ret < 0)
+#define TILE_MIX(h, w) ((h) = ((h) ^ (w)) * 0x100000001b3ull, (h) ^= (h) >> 29)
+
+/* content hash of one tile, never one of the reserved tags; four lanes keep the multiplies independent */
+static uint64_t tile_hash(const uint8_t *p, uint32_t stride, uint32_t bytes, uint32_t rows)
+{
+	uint64_t h[4] = { 0x9e3779b97f4a7c15ull, 1, 2, 3 }, w[4];
+	uint32_t i, j;
+
+	for (j = 0; j < rows; j++, p += stride)
 	{
-		fprintf(stderr, "test-only atomic commit failed,%d\n", errno);
-		drmModeAtomicFree(req);
-		return ret;
+		for (i = 0; i + 32 <= bytes; i += 32)
+		{
+			memcpy(w, p + i, sizeof(w));
+			TILE_MIX(h[0], w[0]);
+			TILE_MIX(h[1], w[1]);
+			TILE_MIX(h[2], w[2]);
+			TILE_MIX(h[3], w[3]);
+		}
+		for (; i < bytes; i += 8)
+		{
+			w[0] = 0;
+			memcpy(&w[0], p + i, bytes - i < 8 ? bytes - i : 8);
+			TILE_MIX(h[0], w[0]);
+		}
 	}
 
-	for (iter = device_list; iter; iter = iter->next)
-	{
-		iter->r = rand() % 0xff;
-		iter->g = rand() % 0xff;
-		iter->b = rand() % 0xff;
-		iter->r_up = iter->g_up = iter->b_up = true;
+	TILE_MIX(h[0], h[1]);
+	TILE_MIX(h[0], h[2]);
+	TILE_MIX(h[0], h[3]);
+	return h[0] <= TILE_BLACK ? h[0] + TILE_BLACK + 1 : h[0];
+}
 
-		modeset_draw_framebuffer(iter);
+/*
+ * Tile codec of the slide cache. Each tile is a stream of tokens on whole
+ * pixels, the op in the top two bits and the length - 1 in the low six,
+ * continued LZ4 style with bytes added while they are 255:
+ *   literal  the pixels follow
+ *   run      one pixel follows, repeated
+ *   match    a 16-bit pixel offset follows, copy from that far back
+ * Matches read back decoded pixels, which must not come from a dumb
+ * buffer (often write-combined), so tiles decode into an L1 sized scratch
+ * and are stored at the buffer stride from there.
+ */
+#define PACK_LITERAL 0
+#define PACK_RUN 1
+#define PACK_MATCH 2
+#define PACK_MIN_RUN 4
+#define PACK_MIN_MATCH 3
+#define PACK_HASH_BITS 12
+/* decoders copy in 16 byte chunks and may read or write this far past a tile */
+#define PACK_SLACK 16
+#define PACK_BOUND(pixels, bpp) ((size_t)(pixels) * ((bpp) + 1) + 16)
+
+static uint8_t *pack_token(uint8_t *out, unsigned int op, uint32_t n)
+{
+	n -= 1;
+	if (n < 63)
+	{
+		*out++ = op << 6 | n;
+		return out;
 	}
 
-	flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_ALLOW_MODESET;
-	ret = drmModeAtomicCommit(fd, req, flags, NULL);
-	if (ret < 0)
-		fprintf(stderr, "test-only atomic commit failed,%d\n", errno);
-
-	drmModeAtomicFree(req);
-	return ret;
+	*out++ = op << 6 | 63;
+	for (n -= 63; n >= 255; n -= 255)
+		*out++ = 255;
+	*out++ = n;
+	return out;
 }
 
-static void modeset_draw(int fd)
+static uint8_t *pack_literals(uint8_t *out, const uint8_t *src, uint32_t n, uint32_t bpp)
 {
-	drmEventContext ev;
-	memset(&ev, 0, sizeof(ev));
-	ev.version = 3;
-	ev.page_flip_handler2 = modeset_page_flip_event;
-
-	modeset_perform_modeset(fd);
-	drmHandleEvent(fd, &ev);
+	if (!n)
+		return out;
+	out = pack_token(out, PACK_LITERAL, n);
+	memcpy(out, src, (size_t)n * bpp);
+	return out + (size_t)n * bpp;
 }
 
-static void modeset_cleanup(int fd)
+/* length of the common prefix of @a and @b, at most @max bytes */
+static size_t pack_common(const uint8_t *a, const uint8_t *b, size_t max)
 {
-	struct modeset_device *iter;
-	drmEventContext ev;
-	int ret;
+	uint64_t wa, wb;
+	size_t i;
 
-	memset(&ev, 0, sizeof(ev));
-	ev.version = 3;
-	ev.page_flip_handler2 = modeset_page_flip_event;
+	for (i = 0; i + 8 <= max; i += 8)
+	{
+		memcpy(&wa, a + i, sizeof(wa));
+		memcpy(&wb, b + i, sizeof(wb));
+		if (wa != wb)
+			return i + __builtin_ctzll(wa ^ wb) / 8;
+	}
+	while (i < max && a[i] == b[i])
+		i++;
+	return i;
+}
 
-	while (device_list)
+/*
+ * Greedy encoder for a tile of @w x @h contiguous pixels. At each pixel
+ * it tries a run, the pixel above and the last position with the same
+ * two pixels, and takes the longest.
+ */
+static size_t tile_pack(uint8_t *out, const uint8_t *src, uint32_t w, uint32_t h, uint32_t bpp)
+{
+	int16_t table[1 << PACK_HASH_BITS];
+	uint32_t n = w * h, i = 0, lit = 0, run, len, best, off, key;
+	uint64_t pair;
+	uint8_t *o = out;
+	int cand;
+
+	memset(table, 0xff, sizeof(table));
+	while (i < n)
 	{
-		iter = device_list;
+		run = pack_common(src + (size_t)i * bpp, src + (size_t)(i + 1) * bpp, (size_t)(n - i - 1) * bpp) / bpp + 1;
 
-		iter->cleanup = true;
-		fprintf(stderr, "wait for pending page-flip to complete...\n");
-		while (iter->pflip_pending)
+		best = off = 0;
+		if (i >= w)
 		{
-			ret = drmHandleEvent(fd, &ev);
-			if (ret)
-				break;
+			best = pack_common(src + (size_t)i * bpp, src + (size_t)(i - w) * bpp, (size_t)(n - i) * bpp) / bpp;
+			off = w;
+		}
+		if (i + 1 < n)
+		{
+			pair = 0;
+			memcpy(&pair, src + (size_t)i * bpp, 2 * bpp);
+			key = (pair * 0x9e3779b97f4a7c15ull) >> (64 - PACK_HASH_BITS);
+			cand = table[key];
+			table[key] = i;
+			if (cand >= 0 && i - cand != off)
+			{
+				len = pack_common(src + (size_t)i * bpp, src + (size_t)cand * bpp, (size_t)(n - i) * bpp) / bpp;
+				if (len > best)
+				{
+					best = len;
+					off = i - cand;
+				}
+			}
 		}
 
-		device_list = iter->next;
-
-		modeset_device_destory(fd, iter);
+		if (run >= PACK_MIN_RUN && run >= best)
+		{
+			o = pack_literals(o, src + (size_t)(i - lit) * bpp, lit, bpp);
+			o = pack_token(o, PACK_RUN, run);
+			memcpy(o, src + (size_t)i * bpp, bpp);
+			o += bpp;
+			i += run;
+			lit = 0;
+		}
+		else if (best >= PACK_MIN_MATCH)
+		{
+			o = pack_literals(o, src + (size_t)(i - lit) * bpp, lit, bpp);
+			o = pack_token(o, PACK_MATCH, best);
+			*o++ = off & 0xff;
+			*o++ = off >> 8;
+			i += best;
+			lit = 0;
+		}
+		else
+		{
+			i++;
+			lit++;
+		}
 	}
+
+	o = pack_literals(o, src + (size_t)(n - lit) * bpp, lit, bpp);
+	return o - out;
 }
 
-#if 0
-static int g_terminate = 0;
-void signal_handler(int signo)
+/* decode a tile of @size bytes into @out, which has PACK_SLACK bytes to spare */
+static int tile_unpack(uint8_t *out, size_t size, const uint8_t *in, const uint8_t *end, uint32_t bpp)
 {
-    switch (signo) {
-        case SIGUSR1:
-        case SIGUSR2:
-        case SIGTERM:
-        case SIGKILL:
-            g_terminate = 1;
-            break;
-        default:
-            break;
-    }
+	uint8_t *o = out, *oend = out + size;
+	uint32_t n, off, k, p;
+	unsigned int op;
+	v4su v;
+
+	while (in < end)
+	{
+		op = *in >> 6;
+		n = *in++ & 63;
+		if (n == 63)
+		{
+			do
+			{
+				if (in == end)
+					return -EINVAL;
+				k = *in++;
+				n += k;
+			} while (k == 255);
+		}
+		n = (n + 1) * bpp;
+		if (n > (size_t)(oend - o))
+			return -EINVAL;
+
+		switch (op)
+		{
+		case PACK_LITERAL:
+			if (n > (size_t)(end - in))
+				return -EINVAL;
+			for (k = 0; k < n; k += 16)
+				memcpy(o + k, in + k, 16);
+			in += n;
+			break;
+		case PACK_RUN:
+			if (bpp > (size_t)(end - in))
+				return -EINVAL;
+			p = 0;
+			memcpy(&p, in, bpp);
+			in += bpp;
+			if (bpp == 2)
+				p |= p << 16;
+			v = (v4su){ p, p, p, p };
+			for (k = 0; k < n; k += 16)
+				memcpy(o + k, &v, sizeof(v));
+			break;
+		case PACK_MATCH:
+			if (end - in < 2)
+				return -EINVAL;
+			off = (in[0] | in[1] << 8) * bpp;
+			in += 2;
+			if (!off || off > (size_t)(o - out))
+				return -EINVAL;
+			/* chunks never overlap their source once it is 16 bytes back */
+			if (off >= 16)
+			{
+				for (k = 0; k < n; k += 16)
+					memcpy(o + k, o + k - off, 16);
+			}
+			else
+			{
+				for (k = 0; k < n; k++)
+					o[k] = (o - off)[k];
+			}
+			break;
+		default:
+			return -EINVAL;
+		}
+		o += n;
+	}
+
+	return o == oend ? 0 : -EINVAL;
 }
 
-/* Install OS signal handler */
-sighandler_t sig_install_handler(int sig, sighandler_t handler)
+struct packed_tile
 {
-    struct sigaction add_sig;
+	uint32_t offset;
+	uint32_t size : 31;
+	/*
+	 * has pixels that were transparent in the decoded image, a background
+	 * shows through them; their TILE_MASK_BITS coverage follows the tile
+	 */
+	uint32_t see_through : 1;
+};
 
-    /* get current signal action */
-    if (sigaction(sig, NULL, &add_sig) < 0) {
-        qCritical() << "sigaction() #1: failed:" << strerror(errno);
-        return SIG_ERR;
-    }
+/* a still slide has one frame, tiles an animation frame did not change share the packed pixels */
+struct slide_frame
+{
+	uint64_t *tiles;
+	struct packed_tile *pack;
+	uint64_t start_ns;
+	uint64_t delay_ns;
+};
 
-    add_sig.sa_handler = handler;
+/*
+ * A decoded slide, in the pixel format of the buffer it is shown on, so
+ * filling a back buffer is a copy of unpacked tiles. Slides are cached
+ * per size, format and rotation, not per buffer: outputs of the same
+ * resolution share them, also across cards whose pitches differ.
+ */
+struct slide
+{
+	struct slide *next;
+	unsigned int index;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format;
+	uint32_t rotation;
+	/* decoded pixels of the frame being packed */
+	uint8_t *data;
+	/* and their alpha if the format has no room for it, see slide_finish() */
+	uint8_t *alpha;
+
+	struct slide_frame *frames;
+	unsigned int frame_count;
+	/* animations stop on the last frame after this many plays, 0 loops */
+	unsigned int plays;
+	uint64_t duration_ns;
+
+	uint8_t *packed;
+	size_t packed_size;
+	size_t packed_cap;
+	uint64_t last_used;
+	/* the built-in splash standing in for a missing file, looked for again at this time */
+	uint64_t standin_ns;
+};
 
-    /* set signal number to signal set mask */
-    if (sigaddset(&add_sig.sa_mask, sig)) {
+static struct slide *slide_list = NULL;
+
+/* packed slides are evicted least recently used first beyond this (-M) */
+static size_t slide_budget = 64 << 20;
+static size_t slide_cache_size;
+static uint64_t slide_clock;
+/* slides used at or after this clock are about to be drawn and stay cached */
+static uint64_t slide_pinned = UINT64_MAX;
+/* slides that fail to load are not cached but retried on every draw, reported once */
+static unsigned int slide_missing = UINT_MAX;
+
+/*
+ * Streaming separable resampler. Source rows are pushed one at a time,
+ * filtered horizontally into a ring of v_taps rows, and every output row
+ * whose vertical window is complete is written straight to its place in
+ * the destination. Memory is a handful of output rows plus the weight
+ * tables, independent of the source height.
+ */
+#define RESAMPLE_SHIFT 14
+
+struct resample
+{
+	uint32_t src_w, src_h;
+	uint32_t dst_w, dst_h;
+	uint8_t *dst;
+	uint32_t dst_stride;
+
+	int h_taps, v_taps;
+	int32_t *h_first, *v_first;
+	int16_t *h_weight, *v_weight;
+
+	uint8_t *ring;
+	int32_t *acc;
+	uint32_t rows_in;
+	uint32_t rows_out;
+};
+
+/* triangle filter widened to the scale factor when shrinking */
+static void resample_weights(uint32_t src, uint32_t dst, int taps, int32_t *first, int16_t *weight)
+{
+	double scale = (double)src / dst, support = scale > 1.0 ? scale : 1.0;
+	double center, w[taps], sum;
+	int lo, hi, k, total, max_k, shift;
+	int16_t *ow;
+	uint32_t o;
+
+	for (o = 0; o < dst; o++)
+	{
+		center = (o + 0.5) * scale;
+		lo = (int)floor(center - support);
+		hi = (int)ceil(center + support);
+		if (lo < 0)
+			lo = 0;
+		if (hi > (int)src)
+			hi = src;
+		if (hi - lo > taps)
+			hi = lo + taps;
+
+		sum = 0;
+		for (k = 0; k < hi - lo; k++)
+		{
+			w[k] = 1.0 - fabs((lo + k + 0.5 - center) / support);
+			if (w[k] < 0)
+				w[k] = 0;
+			sum += w[k];
+		}
+
+		/*
+		 * Every output uses exactly @taps inputs so the kernels need no
+		 * bounds checks: windows at the right edge are moved left and
+		 * padded with zero weights in front.
+		 */
+		shift = lo + taps > (int)src ? lo + taps - src : 0;
+		ow = &weight[o * taps];
+		memset(ow, 0, taps * sizeof(*ow));
+
+		/* round to fixed point, the rounding error goes to the biggest tap */
+		total = max_k = 0;
+		for (k = 0; k < hi - lo; k++)
+		{
+			ow[k + shift] = sum > 0 ? (int16_t)lrint(w[k] / sum * (1 << RESAMPLE_SHIFT)) : 0;
+			total += ow[k + shift];
+			if (ow[k + shift] > ow[max_k])
+				max_k = k + shift;
+		}
+		ow[max_k] += (1 << RESAMPLE_SHIFT) - total;
+		first[o] = lo - shift;
+	}
+}
+
+static void resample_free(struct resample *rs)
+{
+	free(rs->h_first);
+	free(rs->v_first);
+	free(rs->h_weight);
+	free(rs->v_weight);
+	free(rs->ring);
+	free(rs->acc);
+	memset(rs, 0, sizeof(*rs));
+}
+
+static int resample_taps(uint32_t src, uint32_t dst)
+{
+	int taps;
+
+	taps = 2 * (int)ceil(src > dst ? (double)src / dst : 1.0) + 1;
+	return taps > (int)src ? (int)src : taps;
+}
+
+static int resample_init(struct resample *rs, uint32_t src_w, uint32_t src_h,
+						 uint32_t dst_w, uint32_t dst_h, uint8_t *dst, uint32_t dst_stride)
+{
+	memset(rs, 0, sizeof(*rs));
+	rs->src_w = src_w;
+	rs->src_h = src_h;
+	rs->dst_w = dst_w;
+	rs->dst_h = dst_h;
+	rs->dst = dst;
+	rs->dst_stride = dst_stride;
+
+	/* identity, rows are copied as they come */
+	if (src_w == dst_w && src_h == dst_h)
+		return 0;
+
+	rs->h_taps = resample_taps(src_w, dst_w);
+	rs->v_taps = resample_taps(src_h, dst_h);
+
+	rs->h_first = malloc(dst_w * sizeof(*rs->h_first));
+	rs->v_first = malloc(dst_h * sizeof(*rs->v_first));
+	rs->h_weight = malloc((size_t)dst_w * rs->h_taps * sizeof(*rs->h_weight));
+	rs->v_weight = malloc((size_t)dst_h * rs->v_taps * sizeof(*rs->v_weight));
+	rs->ring = malloc((size_t)dst_w * 4 * rs->v_taps);
+	rs->acc = malloc((size_t)dst_w * 4 * sizeof(*rs->acc));
+	if (!rs->h_first || !rs->v_first || !rs->h_weight || !rs->v_weight || !rs->ring || !rs->acc)
+	{
+		resample_free(rs);
+		return -ENOMEM;
+	}
+
+	resample_weights(src_w, dst_w, rs->h_taps, rs->h_first, rs->h_weight);
+	resample_weights(src_h, dst_h, rs->v_taps, rs->v_first, rs->v_weight);
+	return 0;
+}
+
+static inline uint8_t resample_clamp(int32_t acc)
+{
+	acc = (acc + (1 << (RESAMPLE_SHIFT - 1))) >> RESAMPLE_SHIFT;
+	return acc < 0 ? 0 : acc > 255 ? 255 : acc;
+}
+
+/* one tap at a time over the whole row, 16 bytes per vector step */
+static void resample_emit(struct resample *rs, uint32_t o)
+{
+	const int16_t *w = &rs->v_weight[o * rs->v_taps];
+	uint8_t *out = rs->dst + (size_t)rs->dst_stride * o;
+	uint32_t row_bytes = rs->dst_w * 4, i;
+	int32_t *restrict acc = rs->acc;
+	const uint8_t *restrict row;
+	v16si a, m;
+	v16qu b;
+	int k;
+
+	memset(acc, 0, row_bytes * sizeof(*acc));
+	for (k = 0; k < rs->v_taps; k++)
+	{
+		if (!w[k])
+			continue;
+		row = rs->ring + (size_t)row_bytes * ((rs->v_first[o] + k) % rs->v_taps);
+		for (i = 0; i + 16 <= row_bytes; i += 16)
+		{
+			memcpy(&a, &acc[i], sizeof(a));
+			memcpy(&b, &row[i], sizeof(b));
+			a += __builtin_convertvector(b, v16si) * w[k];
+			memcpy(&acc[i], &a, sizeof(a));
+		}
+		for (; i < row_bytes; i++)
+			acc[i] += w[k] * row[i];
+	}
+
+	for (i = 0; i + 16 <= row_bytes; i += 16)
+	{
+		memcpy(&a, &acc[i], sizeof(a));
+		a = (a + (1 << (RESAMPLE_SHIFT - 1))) >> RESAMPLE_SHIFT;
+		a &= ~(a < 0);
+		m = a > 255;
+		a = (a & ~m) | (m & 255);
+		b = __builtin_convertvector(a, v16qu);
+		memcpy(&out[i], &b, sizeof(b));
+	}
+	for (; i < row_bytes; i++)
+		out[i] = resample_clamp(acc[i]);
+}
+
+/* all four channels of a pixel are filtered as one vector */
+static void resample_row_h(const struct resample *rs, const uint8_t *src, uint8_t *row)
+{
+	const int16_t *w;
+	const uint8_t *p;
+	v4si acc, px;
+	uint32_t x;
+	int k, c;
+
+	for (x = 0; x < rs->dst_w; x++)
+	{
+		w = &rs->h_weight[x * rs->h_taps];
+		p = src + rs->h_first[x] * 4;
+		acc = (v4si){ 0, 0, 0, 0 };
+		for (k = 0; k < rs->h_taps; k++, p += 4)
+		{
+			px = (v4si){ p[0], p[1], p[2], p[3] };
+			acc += px * w[k];
+		}
+		for (c = 0; c < 4; c++)
+			row[x * 4 + c] = resample_clamp(acc[c]);
+	}
+}
+
+/* push the next XRGB8888 source row */
+static void resample_push_row(struct resample *rs, const uint8_t *src)
+{
+	uint32_t needed;
+
+	if (!rs->ring)
+	{
+		if (rs->rows_in < rs->dst_h)
+			memcpy(rs->dst + (size_t)rs->dst_stride * rs->rows_in, src, rs->dst_w * 4);
+		rs->rows_in++;
+		return;
+	}
+
+	resample_row_h(rs, src, rs->ring + (size_t)rs->dst_w * 4 * (rs->rows_in % rs->v_taps));
+	rs->rows_in++;
+
+	while (rs->rows_out < rs->dst_h)
+	{
+		needed = rs->v_first[rs->rows_out] + rs->v_taps;
+		if (needed > rs->rows_in)
+			break;
+		resample_emit(rs, rs->rows_out++);
+	}
+}
+
+/* 4x4 ordered dither thresholds, 0..15 */
+static const uint8_t bayer4[4][4] = {
+	{ 0, 8, 2, 10 },
+	{ 12, 4, 14, 6 },
+	{ 3, 11, 1, 9 },
+	{ 15, 7, 13, 5 },
+};
+
+/*
+ * XRGB8888 to RGB565 with ordered dithering. Four pixels per vector step
+ * line up with the four columns of the Bayer matrix, so the threshold
+ * vectors are loaded once per row. The bits that get cut (3 for red and
+ * blue, 2 for green) are dithered with the threshold scaled to that range.
+ */
+static void convert_row_rgb565(uint16_t *dst, const uint32_t *src, uint32_t width, uint32_t y)
+{
+	const uint8_t *t = bayer4[y & 3];
+	const v4su d5 = { t[0] >> 1, t[1] >> 1, t[2] >> 1, t[3] >> 1 };
+	const v4su d6 = { t[0] >> 2, t[1] >> 2, t[2] >> 2, t[3] >> 2 };
+	v4su p, r, g, b, m;
+	v4hu out;
+	uint32_t x, pr, pg, pb;
+
+	for (x = 0; x + 4 <= width; x += 4)
+	{
+		memcpy(&p, &src[x], sizeof(p));
+		r = ((p >> 16) & 0xff) + d5;
+		g = ((p >> 8) & 0xff) + d6;
+		b = (p & 0xff) + d5;
+
+		m = (v4su)(r > 255);
+		r = (r & ~m) | (m & 255);
+		m = (v4su)(g > 255);
+		g = (g & ~m) | (m & 255);
+		m = (v4su)(b > 255);
+		b = (b & ~m) | (m & 255);
+
+		out = __builtin_convertvector(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3), v4hu);
+		memcpy(&dst[x], &out, sizeof(out));
+	}
+
+	for (; x < width; x++)
+	{
+		pr = ((src[x] >> 16) & 0xff) + (t[x & 3] >> 1);
+		pg = ((src[x] >> 8) & 0xff) + (t[x & 3] >> 2);
+		pb = (src[x] & 0xff) + (t[x & 3] >> 1);
+		pr = pr > 255 ? 255 : pr;
+		pg = pg > 255 ? 255 : pg;
+		pb = pb > 255 ? 255 : pb;
+		dst[x] = ((pr >> 3) << 11) | ((pg >> 2) << 5) | (pb >> 3);
+	}
+}
+
+/* XRGB8888 to XRGB2101010, the top bits are replicated so white stays white */
+static void convert_row_xrgb2101010(uint32_t *dst, const uint32_t *src, uint32_t width)
+{
+	v4su p, r, g, b;
+	uint32_t x, cr, cg, cb;
+
+	for (x = 0; x + 4 <= width; x += 4)
+	{
+		memcpy(&p, &src[x], sizeof(p));
+		r = (p >> 16) & 0xff;
+		g = (p >> 8) & 0xff;
+		b = p & 0xff;
+		p = (((r << 2) | (r >> 6)) << 20) | (((g << 2) | (g >> 6)) << 10) | (b << 2) | (b >> 6);
+		memcpy(&dst[x], &p, sizeof(p));
+	}
+
+	for (; x < width; x++)
+	{
+		cr = (src[x] >> 16) & 0xff;
+		cg = (src[x] >> 8) & 0xff;
+		cb = src[x] & 0xff;
+		dst[x] = (((cr << 2) | (cr >> 6)) << 20) | (((cg << 2) | (cg >> 6)) << 10) | (cb << 2) | (cb >> 6);
+	}
+}
+
+/* write one XRGB8888 row as @format, @y selects the dither row */
+static void convert_row(uint32_t format, uint8_t *dst, const uint32_t *src, uint32_t width, uint32_t y)
+{
+	switch (format)
+	{
+	case DRM_FORMAT_RGB565:
+		convert_row_rgb565((uint16_t *)dst, src, width, y);
+		break;
+	case DRM_FORMAT_XRGB2101010:
+		convert_row_xrgb2101010((uint32_t *)dst, src, width);
+		break;
+	default:
+		memcpy(dst, src, width * 4);
+		break;
+	}
+}
+
+/* the background resolved for one buffer, see background_setup() */
+struct background_geom
+{
+	enum background_kind kind;
+	uint32_t from;
+	uint32_t to;
+	/* mixed into the tags of tiles the background shows in */
+	uint64_t tag;
+	/* linear: ramp position 0..1 of pixel center (x, y) is a * x + b * y + c */
+	double a, b, c;
+	/* radial: ramp position is the distance from (cx, cy) times scale */
+	float cx, cy, scale;
+};
+
+/*
+ * Place the background on @buf, whose content is rotated by @rotation, so
+ * a linear gradient keeps its angle on the upright screen. A radial one
+ * is the same either way.
+ */
+static void background_setup(struct background_geom *g, const struct modeset_buf *buf, uint32_t rotation,
+							 uint32_t from, uint32_t to)
+{
+	struct orient o = orient_get(rotation);
+	double w = buf->width, h = buf->height, lw, lh, cs, sn, len;
+	/* upright x and y of a buffer pixel as [0] * x + [1] * y + [2] */
+	double ux[3] = { 1, 0, 0 }, uy[3] = { 0, 1, 0 };
+
+	memset(g, 0, sizeof(*g));
+	g->kind = background.kind;
+	g->from = from;
+	g->to = to;
+	g->tag = 0x9e3779b97f4a7c15ull;
+	TILE_MIX(g->tag, g->kind);
+	TILE_MIX(g->tag, ((uint64_t)from << 32) | to);
+
+	if (g->kind == BACKGROUND_LINEAR)
+	{
+		lw = o.transpose ? h : w;
+		lh = o.transpose ? w : h;
+		if (o.transpose)
+		{
+			ux[0] = 0;
+			ux[1] = o.flip_y ? -1 : 1;
+			ux[2] = o.flip_y ? h : 0;
+			uy[0] = o.flip_x ? -1 : 1;
+			uy[1] = 0;
+			uy[2] = o.flip_x ? w : 0;
+		}
+		else
+		{
+			ux[0] = o.flip_x ? -1 : 1;
+			ux[2] = o.flip_x ? w : 0;
+			uy[1] = o.flip_y ? -1 : 1;
+			uy[2] = o.flip_y ? h : 0;
+		}
+
+		/* the ramp spans the screen along the angle, corner to corner */
+		cs = cos(background.angle * M_PI / 180);
+		sn = sin(background.angle * M_PI / 180);
+		len = fabs(lw * cs) + fabs(lh * sn);
+		g->a = (ux[0] * cs + uy[0] * sn) / len;
+		g->b = (ux[1] * cs + uy[1] * sn) / len;
+		g->c = 0.5 + ((ux[2] - lw / 2) * cs + (uy[2] - lh / 2) * sn) / len;
+	}
+	else if (g->kind == BACKGROUND_RADIAL)
+	{
+		g->cx = w / 2;
+		g->cy = h / 2;
+		g->scale = 2 / sqrt(w * w + h * h);
+	}
+}
+
+/* tag of a tile showing the background under @tag, never one of the reserved ones */
+static inline uint64_t background_tile_tag(uint64_t tag, const struct background_geom *g)
+{
+	TILE_MIX(tag, g->tag);
+	return tag <= TILE_BLACK ? tag + TILE_BLACK + 1 : tag;
+}
+
+/*
+ * Colors at ramp positions @t (0..1) from @f to @f + @d per channel, red
+ * first. The ordered @dither (0..15/16) on the fraction keeps slow
+ * gradients from banding, it never carries a channel past either end.
+ * Float lanes, as 32-bit integer multiplies are not in baseline SSE2.
+ */
+static inline v4su background_ramp(v4sf t, v4sf dither, const v4sf f[3], const v4sf d[3])
+{
+	return (v4su)((__builtin_convertvector(f[0] + d[0] * t + dither, v4si) << 16) |
+				  (__builtin_convertvector(f[1] + d[1] * t + dither, v4si) << 8) |
+				  __builtin_convertvector(f[2] + d[2] * t + dither, v4si));
+}
+
+static inline v4sf background_clamp(v4sf t)
+{
+	v4si m;
+
+	m = t < 0;
+	t = (v4sf)((v4si)t & ~m);
+	m = t > 1;
+	return (v4sf)(((v4si)t & ~m) | ((v4si)((v4sf){ 1, 1, 1, 1 }) & m));
+}
+
+/* XRGB8888 background of pixels @x..@x + @width - 1 of row @y, @x is a multiple of 4 */
+static void background_row(const struct background_geom *g, uint32_t *dst, uint32_t x, uint32_t y, uint32_t width)
+{
+	const uint8_t *b = bayer4[y & 3];
+	const v4sf dither = { b[0] / 16.f, b[1] / 16.f, b[2] / 16.f, b[3] / 16.f };
+	const v4sf lane = { 0, 1, 2, 3 };
+	const uint32_t from = g->from, to = g->to;
+	const bool linear = g->kind == BACKGROUND_LINEAR;
+	const float scale = g->scale, dy2 = (y + 0.5f - g->cy) * (y + 0.5f - g->cy) + 1e-3f;
+	v4sf f[3], d[3], t, step, fx, d2, r;
+	uint32_t i, k;
+	v4si bits;
+	v4su out;
+
+	if (!linear && g->kind != BACKGROUND_RADIAL)
+	{
+		out = (v4su){ 0, 0, 0, 0 } + from;
+		for (i = 0; i + 4 <= width; i += 4)
+			memcpy(&dst[i], &out, sizeof(out));
+		for (; i < width; i++)
+			dst[i] = from;
+		return;
+	}
+
+	for (k = 0; k < 3; k++)
+	{
+		f[k] = (v4sf){ 0, 0, 0, 0 } + (float)((from >> (16 - 8 * k)) & 0xff);
+		d[k] = (v4sf){ 0, 0, 0, 0 } + (float)((int)((to >> (16 - 8 * k)) & 0xff) - (int)((from >> (16 - 8 * k)) & 0xff));
+	}
+
+	/* linear: t steps by a per pixel; radial: fx is the distance from the center column */
+	t = (float)(g->a * (x + 0.5) + g->b * (y + 0.5) + g->c) + lane * (float)g->a;
+	step = (v4sf){ 0, 0, 0, 0 } + (float)(g->a * 4);
+	fx = lane + (x + 0.5f - g->cx);
+	for (i = 0; i < width; i += 4)
+	{
+		if (!linear)
+		{
+			/* distance as d2 / sqrt(d2), the reciprocal root by bit trick and two Newton steps */
+			d2 = fx * fx + dy2;
+			memcpy(&bits, &d2, sizeof(bits));
+			bits = 0x5f3759df - (bits >> 1);
+			memcpy(&r, &bits, sizeof(r));
+			r = r * (1.5f - 0.5f * d2 * r * r);
+			r = r * (1.5f - 0.5f * d2 * r * r);
+			t = d2 * r * scale;
+		}
+		out = background_ramp(background_clamp(t), dither, f, d);
+		if (i + 4 <= width)
+			memcpy(&dst[i], &out, sizeof(out));
+		else
+			for (k = 0; i + k < width; k++)
+				dst[i + k] = out[k];
+		/* float steps drift by well under a level across a 4K row */
+		if (linear)
+			t += step;
+		fx += 4;
+	}
+}
+
+/* coverage of a see-through tile, a bit per pixel in row order, set where the slide is opaque */
+#define TILE_MASK_BITS(pixels) (((pixels) + 7) / 8)
+
+static inline bool tile_covered(const uint8_t *mask, uint32_t bit)
+{
+	return mask[bit >> 3] >> (bit & 7) & 1;
+}
+
+/*
+ * Compose a row of @width slide pixels @src over the background @bg,
+ * @bpp bytes each: pixels whose coverage bit in @mask, from bit @bit on,
+ * is clear were transparent, like the letterbox of a fitted slide or the
+ * surroundings of a logo, and show the background. Runs of the same
+ * coverage are copied whole.
+ */
+static void background_under(uint8_t *dst, const uint8_t *src, const uint8_t *bg, const uint8_t *mask,
+							 uint32_t bit, uint32_t width, uint32_t bpp)
+{
+	uint32_t i, k;
+	bool covered;
+
+	for (i = 0; i < width; i = k)
+	{
+		covered = tile_covered(mask, bit + i);
+		for (k = i + 1; k < width && tile_covered(mask, bit + k) == covered; k++)
+			;
+		memcpy(dst + i * bpp, (covered ? src : bg) + i * bpp, (k - i) * bpp);
+	}
+}
+
+/*
+ * Coverage of a @w x @h tile from its alpha, @step bytes apart in rows of
+ * @stride, into @mask. Returns whether any pixel is fully transparent,
+ * a NULL @alpha is opaque.
+ */
+static bool tile_coverage(uint8_t *mask, const uint8_t *alpha, uint32_t stride, uint32_t step, uint32_t w, uint32_t h)
+{
+	uint32_t x, y, bit;
+	bool see_through = false;
+
+	if (!alpha)
+		return false;
+
+	memset(mask, 0, TILE_MASK_BITS(w * h));
+	for (y = 0, bit = 0; y < h; y++, alpha += stride)
+	{
+		for (x = 0; x < w; x++, bit++)
+		{
+			if (alpha[x * step])
+				mask[bit >> 3] |= 1 << (bit & 7);
+			else
+				see_through = true;
+		}
+	}
+	return see_through;
+}
+
+#define ROTATE_TILE 32
+
+static inline void rotate_store4(uint32_t *dst, v4su v, bool reverse)
+{
+	if (reverse)
+		v = __builtin_shuffle(v, (v4su){ 3, 2, 1, 0 });
+	memcpy(dst, &v, sizeof(v));
+}
+
+/*
+ * Rotate an XRGB8888 image, strides in pixels. Transposes walk 32x32
+ * tiles so the source and destination rows of a tile stay in L1, and
+ * each 4x4 block is transposed in registers. Used once per cached slide
+ * when the plane cannot rotate.
+ */
+static void rotate_xrgb(uint32_t *dst, uint32_t dst_stride, const uint32_t *src,
+						uint32_t src_w, uint32_t src_h, uint32_t src_stride, uint32_t rotation)
+{
+	const struct orient o = orient_get(rotation);
+	const uint32_t dst_w = o.transpose ? src_h : src_w;
+	const uint32_t dst_h = o.transpose ? src_w : src_h;
+	/* destination row n is row0 + n * row_step, mirrored vertically if needed */
+	uint32_t *row0 = o.flip_y ? dst + (size_t)(dst_h - 1) * dst_stride : dst;
+	const ptrdiff_t row_step = o.flip_y ? -(ptrdiff_t)dst_stride : (ptrdiff_t)dst_stride;
+	uint32_t x, y, tx, ty, x_end, y_end, i;
+	v4su r[4], t[4], c[4];
+	const uint32_t *s;
+	uint32_t *d;
+
+	if (!o.transpose)
+	{
+		for (y = 0; y < src_h; y++)
+		{
+			s = src + (size_t)src_stride * y;
+			d = row0 + y * row_step;
+			if (!o.flip_x)
+			{
+				memcpy(d, s, src_w * 4);
+				continue;
+			}
+			for (x = 0; x + 4 <= src_w; x += 4)
+			{
+				memcpy(&r[0], &s[x], sizeof(r[0]));
+				rotate_store4(&d[dst_w - 4 - x], r[0], true);
+			}
+			for (; x < src_w; x++)
+				d[dst_w - 1 - x] = s[x];
+		}
+		return;
+	}
+
+	for (ty = 0; ty < src_h; ty += ROTATE_TILE)
+	{
+		y_end = ty + ROTATE_TILE < src_h ? ty + ROTATE_TILE : src_h;
+		for (tx = 0; tx < src_w; tx += ROTATE_TILE)
+		{
+			x_end = tx + ROTATE_TILE < src_w ? tx + ROTATE_TILE : src_w;
+			for (y = ty; y + 4 <= y_end; y += 4)
+			{
+				s = src + (size_t)src_stride * y;
+				/* source column x is destination row x */
+				d = row0 + tx * row_step + (o.flip_x ? dst_w - 4 - y : y);
+				for (x = tx; x + 4 <= x_end; x += 4, d += 4 * row_step)
+				{
+					for (i = 0; i < 4; i++)
+						memcpy(&r[i], &s[src_stride * i + x], sizeof(r[i]));
+
+					t[0] = __builtin_shuffle(r[0], r[1], (v4su){ 0, 4, 1, 5 });
+					t[1] = __builtin_shuffle(r[0], r[1], (v4su){ 2, 6, 3, 7 });
+					t[2] = __builtin_shuffle(r[2], r[3], (v4su){ 0, 4, 1, 5 });
+					t[3] = __builtin_shuffle(r[2], r[3], (v4su){ 2, 6, 3, 7 });
+					c[0] = __builtin_shuffle(t[0], t[2], (v4su){ 0, 1, 4, 5 });
+					c[1] = __builtin_shuffle(t[0], t[2], (v4su){ 2, 3, 6, 7 });
+					c[2] = __builtin_shuffle(t[1], t[3], (v4su){ 0, 1, 4, 5 });
+					c[3] = __builtin_shuffle(t[1], t[3], (v4su){ 2, 3, 6, 7 });
+
+					for (i = 0; i < 4; i++)
+						rotate_store4(d + i * row_step, c[i], o.flip_x);
+				}
+				for (; x < x_end; x++)
+				{
+					for (i = 0; i < 4; i++)
+						row0[x * row_step + (o.flip_x ? dst_w - 1 - (y + i) : y + i)] = s[src_stride * i + x];
+				}
+			}
+			for (; y < y_end; y++)
+			{
+				for (x = tx; x < x_end; x++)
+					row0[x * row_step + (o.flip_x ? dst_w - 1 - y : y)] = src[(size_t)src_stride * y + x];
+			}
+		}
+	}
+}
+
+/*
+ * Size and place an image of @src_w x @src_h inside the slide: oversized
+ * images are shrunk to fit keeping their aspect ratio, everything is
+ * centered on black.
+ */
+static void slide_fit(const struct slide *slide, uint32_t src_w, uint32_t src_h,
+					  uint32_t *dst_w, uint32_t *dst_h, uint32_t *off_x, uint32_t *off_y)
+{
+	*dst_w = src_w;
+	*dst_h = src_h;
+	if (src_w > slide->width || src_h > slide->height)
+	{
+		if ((uint64_t)src_w * slide->height > (uint64_t)src_h * slide->width)
+		{
+			*dst_w = slide->width;
+			*dst_h = ((uint64_t)src_h * slide->width + src_w / 2) / src_w;
+		}
+		else
+		{
+			*dst_h = slide->height;
+			*dst_w = ((uint64_t)src_w * slide->height + src_h / 2) / src_h;
+		}
+		if (!*dst_w)
+			*dst_w = 1;
+		if (!*dst_h)
+			*dst_h = 1;
+	}
+
+	*off_x = (slide->width - *dst_w) / 2;
+	*off_y = (slide->height - *dst_h) / 2;
+}
+
+static int slide_resample_init(struct slide *slide, struct resample *rs, uint32_t src_w, uint32_t src_h)
+{
+	uint32_t dst_w, dst_h, off_x, off_y;
+
+	slide_fit(slide, src_w, src_h, &dst_w, &dst_h, &off_x, &off_y);
+	return resample_init(rs, src_w, src_h, dst_w, dst_h,
+						 slide->data + (size_t)slide->stride * off_y + off_x * 4, slide->stride);
+}
+
+struct jpeg_error_jmp
+{
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	struct jpeg_error_jmp *err = (struct jpeg_error_jmp *)cinfo->err;
+
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(err->jmp, 1);
+}
+
+/*
+ * Decode a JPEG at the smallest of 1, 1/2, 1/4 or 1/8 scale that is still
+ * at least the size it is shown at. The scaling is done by the (SIMD)
+ * IDCT itself, so a 4K photo on a 720p panel never has its full
+ * resolution decoded; the resampler takes care of the remaining factor.
+ */
+static int slide_decode_jpeg(struct slide *slide, FILE *fp)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_jmp jerr;
+	struct resample rs;
+	uint8_t *volatile row_buf = NULL;
+	volatile bool rs_valid = false;
+	uint32_t fit_w, fit_h, off_x, off_y;
+	unsigned int denom;
+	JSAMPROW row;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpeg_error_exit;
+	if (setjmp(jerr.jmp))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		if (rs_valid)
+			resample_free(&rs);
+		free(row_buf);
+		return -EINVAL;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, fp);
+	jpeg_read_header(&cinfo, TRUE);
+
+	/* the size the image ends up at */
+	slide_fit(slide, cinfo.image_width, cinfo.image_height, &fit_w, &fit_h, &off_x, &off_y);
+
+	for (denom = 8; denom > 1; denom /= 2)
+	{
+		if (cinfo.image_width / denom >= fit_w && cinfo.image_height / denom >= fit_h)
+			break;
+	}
+
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = denom;
+	cinfo.out_color_space = JCS_EXT_BGRX;
+	cinfo.dct_method = JDCT_ISLOW;
+	jpeg_start_decompress(&cinfo);
+
+	row_buf = malloc(cinfo.output_width * 4);
+	if (!row_buf || slide_resample_init(slide, &rs, cinfo.output_width, cinfo.output_height))
+		longjmp(jerr.jmp, 1);
+	rs_valid = true;
+
+	while (cinfo.output_scanline < cinfo.output_height)
+	{
+		row = row_buf;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+		resample_push_row(&rs, row_buf);
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	resample_free(&rs);
+	free(row_buf);
+	return 0;
+}
+
+/* whatever the source, rows come out as B,G,R,A bytes */
+static void slide_png_transform(png_structp png, png_infop info)
+{
+	int color, depth;
+
+	color = png_get_color_type(png, info);
+	depth = png_get_bit_depth(png, info);
+	if (color == PNG_COLOR_TYPE_PALETTE)
+		png_set_palette_to_rgb(png);
+	if (color == PNG_COLOR_TYPE_GRAY && depth < 8)
+		png_set_expand_gray_1_2_4_to_8(png);
+	if (png_get_valid(png, info, PNG_INFO_tRNS))
+		png_set_tRNS_to_alpha(png);
+	if (depth == 16)
+		png_set_strip_16(png);
+	if (color == PNG_COLOR_TYPE_GRAY || color == PNG_COLOR_TYPE_GRAY_ALPHA)
+		png_set_gray_to_rgb(png);
+	png_set_bgr(png);
+	png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+	png_read_update_info(png, info);
+}
+
+/* compose on black like cairo does for alpha images */
+static void slide_png_premultiply(uint8_t *p, uint32_t width)
+{
+	uint32_t k;
+
+	for (k = 0; k < width; k++, p += 4)
+	{
+		if (p[3] == 0xff)
+			continue;
+		p[0] = p[0] * p[3] / 255;
+		p[1] = p[1] * p[3] / 255;
+		p[2] = p[2] * p[3] / 255;
+	}
+}
+
+/* interlaced PNGs cannot be read row by row, cairo decodes those whole */
+static int slide_decode_png_cairo(struct slide *slide, const char *path)
+{
+	cairo_surface_t *image;
+	struct resample rs;
+	uint32_t i, j;
+	uint8_t *p;
+	int ret;
+
+	image = cairo_image_surface_create_from_png(path);
+	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS)
+	{
+		cairo_surface_destroy(image);
+		return -EINVAL;
+	}
+
+	/* cairo's ARGB32 is premultiplied, so it is already composed on black */
+	if (cairo_image_surface_get_format(image) == CAIRO_FORMAT_RGB24)
+	{
+		/* its X byte is not alpha, the image is opaque */
+		for (j = 0; j < (uint32_t)cairo_image_surface_get_height(image); j++)
+		{
+			p = cairo_image_surface_get_data(image) + (size_t)cairo_image_surface_get_stride(image) * j;
+			for (i = 0; i < (uint32_t)cairo_image_surface_get_width(image); i++)
+				p[i * 4 + 3] = 0xff;
+		}
+	}
+	ret = slide_resample_init(slide, &rs, cairo_image_surface_get_width(image),
+							  cairo_image_surface_get_height(image));
+	if (ret == 0)
+	{
+		for (j = 0; j < rs.src_h; j++)
+			resample_push_row(&rs, cairo_image_surface_get_data(image) +
+									   (size_t)cairo_image_surface_get_stride(image) * j);
+		resample_free(&rs);
+	}
+
+	cairo_surface_destroy(image);
+	return ret;
+}
+
+static int slide_decode_png(struct slide *slide, FILE *fp, const char *path)
+{
+	png_structp png;
+	png_infop info;
+	struct resample rs;
+	uint8_t *volatile row_buf = NULL;
+	volatile bool rs_valid = false;
+	uint32_t width, height, j;
+
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png)
+		return -ENOMEM;
+	info = png_create_info_struct(png);
+	if (!info)
+	{
+		png_destroy_read_struct(&png, NULL, NULL);
+		return -ENOMEM;
+	}
+
+	if (setjmp(png_jmpbuf(png)))
+	{
+		png_destroy_read_struct(&png, &info, NULL);
+		if (rs_valid)
+			resample_free(&rs);
+		free(row_buf);
+		return -EINVAL;
+	}
+
+	png_init_io(png, fp);
+	png_read_info(png, info);
+
+	if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE)
+	{
+		png_destroy_read_struct(&png, &info, NULL);
+		return slide_decode_png_cairo(slide, path);
+	}
+
+	slide_png_transform(png, info);
+
+	width = png_get_image_width(png, info);
+	height = png_get_image_height(png, info);
+	row_buf = malloc((size_t)width * 4);
+	if (!row_buf || slide_resample_init(slide, &rs, width, height))
+		png_error(png, "out of memory");
+	rs_valid = true;
+
+	for (j = 0; j < height; j++)
+	{
+		png_read_row(png, row_buf, NULL);
+
+		slide_png_premultiply(row_buf, width);
+		resample_push_row(&rs, row_buf);
+	}
+
+	png_read_end(png, NULL);
+	png_destroy_read_struct(&png, &info, NULL);
+	resample_free(&rs);
+	free(row_buf);
+	return 0;
+}
+
+/*
+ * Decoders produce upright XRGB8888 into @xrgb, rotation and other formats
+ * are applied once by slide_finish().
+ */
+static int slide_canvas(const struct slide *slide, struct slide *xrgb)
+{
+	*xrgb = *slide;
+	if (!rotation_is_identity(slide->rotation))
+	{
+		if (orient_get(slide->rotation).transpose)
+		{
+			xrgb->width = slide->height;
+			xrgb->height = slide->width;
+		}
+		xrgb->stride = xrgb->width * 4;
+	}
+	else if (slide->format != DRM_FORMAT_XRGB8888)
+		xrgb->stride = slide->width * 4;
+
+	xrgb->data = calloc(xrgb->height, xrgb->stride);
+	return xrgb->data ? 0 : -ENOMEM;
+}
+
+/* rotate and convert the decoded @xrgb into slide->data, @xrgb is consumed */
+static int slide_finish(struct slide *slide, struct slide *xrgb)
+{
+	uint8_t *rotated;
+	uint32_t i, j, stride;
+
+	if (!rotation_is_identity(slide->rotation))
+	{
+		stride = slide->format == DRM_FORMAT_XRGB8888 ? slide->stride : slide->width * 4;
+		rotated = malloc((size_t)stride * slide->height);
+		if (rotated)
+			rotate_xrgb((uint32_t *)rotated, stride / 4, (const uint32_t *)xrgb->data,
+						xrgb->width, xrgb->height, xrgb->stride / 4, slide->rotation);
+		free(xrgb->data);
+		xrgb->data = NULL;
+		if (!rotated)
+			return -ENOMEM;
+		xrgb->data = rotated;
+		xrgb->stride = stride;
+	}
+
+	if (slide->format == DRM_FORMAT_XRGB8888)
+	{
+		slide->data = xrgb->data;
+		xrgb->data = NULL;
+		return 0;
+	}
+
+	/* the format drops alpha, the coverage of the slide is taken from it */
+	slide->data = malloc((size_t)slide->stride * slide->height);
+	slide->alpha = malloc((size_t)slide->width * slide->height);
+	if (slide->data && slide->alpha)
+	{
+		for (j = 0; j < slide->height; j++)
+		{
+			convert_row(slide->format, slide->data + (size_t)slide->stride * j,
+						(const uint32_t *)(xrgb->data + (size_t)xrgb->stride * j), slide->width, j);
+			for (i = 0; i < slide->width; i++)
+				slide->alpha[(size_t)slide->width * j + i] = xrgb->data[(size_t)xrgb->stride * j + i * 4 + 3];
+		}
+	}
+	free(xrgb->data);
+	xrgb->data = NULL;
+	if (!slide->data || !slide->alpha)
+	{
+		free(slide->data);
+		free(slide->alpha);
+		slide->data = NULL;
+		slide->alpha = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* decode @path into @slide, whose geometry is already set */
+static int slide_load(struct slide *slide, const char *path)
+{
+	struct slide xrgb;
+	uint8_t magic[2];
+	FILE *fp;
+	int ret;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -errno;
+
+	ret = slide_canvas(slide, &xrgb);
+	if (ret)
+	{
+		fclose(fp);
+		return ret;
+	}
+
+	ret = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) ? 0 : -EINVAL;
+	rewind(fp);
+	if (ret == 0 && magic[0] == 0xff && magic[1] == 0xd8)
+		ret = slide_decode_jpeg(&xrgb, fp);
+	else if (ret == 0)
+		ret = slide_decode_png(&xrgb, fp, path);
+	fclose(fp);
+
+	if (ret)
+	{
+		free(xrgb.data);
+		return ret;
+	}
+
+	return slide_finish(slide, &xrgb);
+}
+
+/*
+ * Add slide->data as the next frame: hash its tiles and pack the ones that
+ * differ from the previous frame. Tiles outside @region (framebuffer
+ * pixels, NULL for all) are known to be unchanged and not even hashed.
+ * The decoded pixels are freed.
+ */
+static int slide_pack_frame(struct slide *slide, const struct drm_mode_rect *region, uint64_t delay_ns)
+{
+	uint32_t tiles_x, tiles_y, tx, ty, w, h, j, bpp, i, alpha_stride, alpha_step;
+	uint8_t tile[TILE_SIZE * TILE_SIZE * 4], mask[TILE_MASK_BITS(TILE_SIZE * TILE_SIZE)], *grown;
+	struct slide_frame *frame, *prev;
+	const uint8_t *alpha;
+	bool see_through;
+	uint64_t mask_tag;
+	size_t cap;
+
+	bpp = pixel_format_get(slide->format)->bpp / 8;
+	/* the X byte of XRGB8888 still holds the decoded alpha */
+	if (slide->format == DRM_FORMAT_XRGB8888)
+	{
+		alpha = slide->data + 3;
+		alpha_step = 4;
+		alpha_stride = slide->stride;
+	}
+	else
+	{
+		alpha = slide->alpha;
+		alpha_step = 1;
+		alpha_stride = slide->width;
+	}
+	tiles_x = (slide->width + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (slide->height + TILE_SIZE - 1) / TILE_SIZE;
+
+	frame = realloc(slide->frames, sizeof(*frame) * (slide->frame_count + 1));
+	if (!frame)
+		return -ENOMEM;
+	slide->frames = frame;
+	frame = &slide->frames[slide->frame_count];
+	prev = slide->frame_count ? frame - 1 : NULL;
+	frame->tiles = malloc(sizeof(*frame->tiles) * tiles_x * tiles_y);
+	frame->pack = malloc(sizeof(*frame->pack) * tiles_x * tiles_y);
+	if (!frame->tiles || !frame->pack)
+		goto err;
+
+	for (ty = 0, i = 0; ty < tiles_y; ty++)
+	{
+		h = slide->height - ty * TILE_SIZE < TILE_SIZE ? slide->height - ty * TILE_SIZE : TILE_SIZE;
+		for (tx = 0; tx < tiles_x; tx++, i++)
+		{
+			w = slide->width - tx * TILE_SIZE < TILE_SIZE ? slide->width - tx * TILE_SIZE : TILE_SIZE;
+			if (prev && region && (region->x2 <= (int32_t)(tx * TILE_SIZE) || region->x1 >= (int32_t)(tx * TILE_SIZE + w) ||
+								   region->y2 <= (int32_t)(ty * TILE_SIZE) || region->y1 >= (int32_t)(ty * TILE_SIZE + h)))
+			{
+				frame->tiles[i] = prev->tiles[i];
+				frame->pack[i] = prev->pack[i];
+				continue;
+			}
+
+			for (j = 0; j < h; j++)
+				memcpy(tile + w * bpp * j,
+					   slide->data + (size_t)slide->stride * (ty * TILE_SIZE + j) + tx * TILE_SIZE * bpp, w * bpp);
+			see_through = tile_coverage(mask, alpha ? alpha + (size_t)alpha_stride * ty * TILE_SIZE +
+														 (size_t)tx * TILE_SIZE * alpha_step : NULL,
+										alpha_stride, alpha_step, w, h);
+			frame->tiles[i] = tile_hash(tile, w * bpp, w * bpp, h);
+			/* the same colors with other coverage are another tile */
+			if (see_through)
+			{
+				mask_tag = tile_hash(mask, TILE_MASK_BITS(w * h), TILE_MASK_BITS(w * h), 1);
+				TILE_MIX(frame->tiles[i], mask_tag);
+				if (frame->tiles[i] <= TILE_BLACK)
+					frame->tiles[i] += TILE_BLACK + 1;
+			}
+			if (prev && frame->tiles[i] == prev->tiles[i])
+			{
+				frame->pack[i] = prev->pack[i];
+				continue;
+			}
+
+			if (slide->packed_cap - slide->packed_size <
+				PACK_BOUND(w * h, bpp) + TILE_MASK_BITS(w * h) + PACK_SLACK)
+			{
+				cap = slide->packed_cap ? slide->packed_cap * 2 : (size_t)slide->stride * slide->height / 4;
+				cap += PACK_BOUND(TILE_SIZE * TILE_SIZE, bpp) + TILE_MASK_BITS(TILE_SIZE * TILE_SIZE) + PACK_SLACK;
+				grown = realloc(slide->packed, cap);
+				if (!grown)
+					goto err;
+				slide->packed = grown;
+				slide->packed_cap = cap;
+			}
+			frame->pack[i].offset = slide->packed_size;
+			frame->pack[i].size = tile_pack(slide->packed + slide->packed_size, tile, w, h, bpp);
+			frame->pack[i].see_through = see_through;
+			slide->packed_size += frame->pack[i].size;
+			if (see_through)
+			{
+				memcpy(slide->packed + slide->packed_size, mask, TILE_MASK_BITS(w * h));
+				slide->packed_size += TILE_MASK_BITS(w * h);
+			}
+		}
+	}
+
+	frame->start_ns = slide->duration_ns;
+	frame->delay_ns = delay_ns;
+	slide->duration_ns += delay_ns;
+	slide->frame_count++;
+	free(slide->data);
+	free(slide->alpha);
+	slide->data = NULL;
+	slide->alpha = NULL;
+	return 0;
+
+err:
+	free(frame->tiles);
+	free(frame->pack);
+	return -ENOMEM;
+}
+
+/* all frames are packed, give back what the store does not use */
+static void slide_pack_done(struct slide *slide)
+{
+	uint8_t *packed;
+
+	packed = realloc(slide->packed, slide->packed_size + PACK_SLACK);
+	if (packed)
+	{
+		slide->packed = packed;
+		slide->packed_cap = slide->packed_size + PACK_SLACK;
+	}
+}
+
+static size_t slide_footprint(const struct slide *slide)
+{
+	size_t tiles = ((slide->width + TILE_SIZE - 1) / TILE_SIZE) * ((slide->height + TILE_SIZE - 1) / TILE_SIZE);
+
+	return slide->packed_cap + slide->frame_count * (sizeof(struct slide_frame) +
+		   tiles * (sizeof(*slide->frames->tiles) + sizeof(*slide->frames->pack)));
+}
+
+/* free the pixels of @slide, it is kept as an empty entry */
+static void slide_release(struct slide *slide)
+{
+	unsigned int i;
+
+	for (i = 0; i < slide->frame_count; i++)
+	{
+		free(slide->frames[i].tiles);
+		free(slide->frames[i].pack);
+	}
+	free(slide->frames);
+	free(slide->packed);
+	free(slide->data);
+	free(slide->alpha);
+	slide->frames = NULL;
+	slide->frame_count = 0;
+	slide->duration_ns = 0;
+	slide->packed = NULL;
+	slide->packed_size = slide->packed_cap = 0;
+	slide->data = NULL;
+	slide->alpha = NULL;
+}
+
+static void slide_free(struct slide *slide)
+{
+	slide_release(slide);
+	free(slide);
+}
+
+/* delay of frames in a frame directory without a delays file */
+#define ANIM_DEFAULT_DELAY_NS (33 * NSEC_PER_MSEC)
+/* browsers treat shorter APNG delays as this */
+#define ANIM_MIN_DELAY_NS (10 * NSEC_PER_MSEC)
+
+/*
+ * Map @rect of an image of @src_w x @src_h, placed by slide_fit(), to the
+ * slide's pixels. The resampling filter reaches one source pixel around
+ * it, which is as many slide pixels as the scale factor, plus one.
+ */
+static void slide_map_rect(const struct slide *slide, const struct slide *xrgb, uint32_t src_w, uint32_t src_h,
+						   struct drm_mode_rect *rect)
+{
+	const struct orient o = orient_get(slide->rotation);
+	uint32_t dst_w, dst_h, off_x, off_y, margin_x, margin_y;
+	struct drm_mode_rect r;
+
+	slide_fit(xrgb, src_w, src_h, &dst_w, &dst_h, &off_x, &off_y);
+	margin_x = (dst_w + src_w - 1) / src_w + 1;
+	margin_y = (dst_h + src_h - 1) / src_h + 1;
+	r.x1 = off_x + (int64_t)rect->x1 * dst_w / src_w - margin_x;
+	r.y1 = off_y + (int64_t)rect->y1 * dst_h / src_h - margin_y;
+	r.x2 = off_x + ((int64_t)rect->x2 * dst_w + src_w - 1) / src_w + margin_x;
+	r.y2 = off_y + ((int64_t)rect->y2 * dst_h + src_h - 1) / src_h + margin_y;
+	r.x1 = r.x1 < 0 ? 0 : r.x1;
+	r.y1 = r.y1 < 0 ? 0 : r.y1;
+	r.x2 = r.x2 > (int32_t)xrgb->width ? (int32_t)xrgb->width : r.x2;
+	r.y2 = r.y2 > (int32_t)xrgb->height ? (int32_t)xrgb->height : r.y2;
+
+	/* the same steps as rotate_xrgb() */
+	if (o.transpose)
+		*rect = (struct drm_mode_rect){ r.y1, r.x1, r.y2, r.x2 };
+	else
+		*rect = r;
+	if (o.flip_x)
+	{
+		r.x1 = rect->x1;
+		rect->x1 = slide->width - rect->x2;
+		rect->x2 = slide->width - r.x1;
+	}
+	if (o.flip_y)
+	{
+		r.y1 = rect->y1;
+		rect->y1 = slide->height - rect->y2;
+		rect->y2 = slide->height - r.y1;
+	}
+}
+
+/*
+ * Show the premultiplied BGRA @image on the slide and add it as a frame.
+ * Only @changed (image pixels, NULL for all) differs from the last frame.
+ */
+static int slide_add_image(struct slide *slide, const uint8_t *image, uint32_t width, uint32_t height,
+						   const struct drm_mode_rect *changed, uint64_t delay_ns)
+{
+	struct drm_mode_rect region;
+	struct resample rs;
+	struct slide xrgb;
+	uint32_t j;
+	int ret;
+
+	ret = slide_canvas(slide, &xrgb);
+	if (ret)
+		return ret;
+	ret = slide_resample_init(&xrgb, &rs, width, height);
+	if (ret)
+	{
+		free(xrgb.data);
+		return ret;
+	}
+	for (j = 0; j < height; j++)
+		resample_push_row(&rs, image + (size_t)width * 4 * j);
+	resample_free(&rs);
+
+	if (changed)
+	{
+		region = *changed;
+		slide_map_rect(slide, &xrgb, width, height, &region);
+	}
+	ret = slide_finish(slide, &xrgb);
+	if (ret)
+		return ret;
+	return slide_pack_frame(slide, changed ? &region : NULL, delay_ns);
+}
+
+static int anim_filter(const struct dirent *entry)
+{
+	const char *ext = strrchr(entry->d_name, '.');
+
+	return ext && (!strcasecmp(ext, ".png") || !strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg"));
+}
+
+/*
+ * A directory of frames, played in name order. An optional "delays" file
+ * has the delay of each frame in milliseconds, one per line; the last one
+ * repeats.
+ */
+static int slide_open_dir(struct slide *slide, const char *path)
+{
+	struct dirent **names;
+	uint64_t delay_ns = ANIM_DEFAULT_DELAY_NS;
+	char name[PATH_MAX], line[32];
+	FILE *delays;
+	int count, i, ret = 0;
+
+	count = scandir(path, &names, anim_filter, alphasort);
+	if (count < 0)
+		return -errno;
+
+	snprintf(name, sizeof(name), "%s/delays", path);
+	delays = fopen(name, "r");
+
+	for (i = 0; i < count; i++)
+	{
+		if (delays && fgets(line, sizeof(line), delays))
+			delay_ns = strtoull(line, NULL, 10) * NSEC_PER_MSEC;
+		if (delay_ns < ANIM_MIN_DELAY_NS)
+			delay_ns = ANIM_MIN_DELAY_NS;
+
+		snprintf(name, sizeof(name), "%s/%s", path, names[i]->d_name);
+		if (ret == 0)
+		{
+			ret = slide_load(slide, name);
+			if (ret)
+				fprintf(stderr, "cannot load frame '%s' (%d)\n", name, ret);
+		}
+		/* unchanged tiles are found by their hash */
+		if (ret == 0)
+			ret = slide_pack_frame(slide, NULL, delay_ns);
+		free(names[i]);
+	}
+
+	free(names);
+	if (delays)
+		fclose(delays);
+	if (ret == 0 && !slide->frame_count)
+		ret = -ENOENT;
+	return ret;
+}
+
+#define APNG_DISPOSE_NONE 0
+#define APNG_DISPOSE_BACKGROUND 1
+#define APNG_DISPOSE_PREVIOUS 2
+#define APNG_BLEND_SOURCE 0
+#define APNG_BLEND_OVER 1
+
+struct apng_frame
+{
+	struct drm_mode_rect rect;
+	uint64_t delay_ns;
+	uint8_t dispose;
+	uint8_t blend;
+};
+
+/* a growing in-memory PNG file */
+struct apng_buf
+{
+	uint8_t *data;
+	size_t size;
+	size_t cap;
+};
+
+struct apng_reader
+{
+	const uint8_t *p;
+	size_t left;
+};
+
+static inline uint32_t png_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void png_put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static int apng_buf_reserve(struct apng_buf *buf, size_t len)
+{
+	uint8_t *grown;
+	size_t cap;
+
+	if (buf->cap - buf->size >= len)
+		return 0;
+
+	cap = (buf->cap + len) * 2;
+	grown = realloc(buf->data, cap);
+	if (!grown)
+		return -ENOMEM;
+	buf->data = grown;
+	buf->cap = cap;
+	return 0;
+}
+
+static int apng_buf_append(struct apng_buf *buf, const void *data, size_t len)
+{
+	if (apng_buf_reserve(buf, len))
+		return -ENOMEM;
+	memcpy(buf->data + buf->size, data, len);
+	buf->size += len;
+	return 0;
+}
+
+/* CRCs are left zero, the decoder is told not to check them */
+static int apng_buf_chunk(struct apng_buf *buf, const char *type, const uint8_t *data, uint32_t len)
+{
+	if (apng_buf_reserve(buf, (size_t)len + 12))
+		return -ENOMEM;
+
+	png_put_be32(buf->data + buf->size, len);
+	memcpy(buf->data + buf->size + 4, type, 4);
+	if (len)
+		memcpy(buf->data + buf->size + 8, data, len);
+	memset(buf->data + buf->size + 8 + len, 0, 4);
+	buf->size += (size_t)len + 12;
+	return 0;
+}
+
+static void apng_read(png_structp png, png_bytep out, png_size_t len)
+{
+	struct apng_reader *rd = png_get_io_ptr(png);
+
+	if (len > rd->left)
+		png_error(png, "truncated frame");
+	memcpy(out, rd->p, len);
+	rd->p += len;
+	rd->left -= len;
+}
+
+/* decode one frame, reassembled as a standalone PNG, to premultiplied BGRA */
+static int apng_decode_frame(const struct apng_buf *buf, uint8_t *out, uint32_t width, uint32_t height)
+{
+	struct apng_reader rd = { buf->data, buf->size };
+	png_bytep *volatile rows = NULL;
+	png_structp png;
+	png_infop info;
+	uint32_t j;
+
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png)
+		return -ENOMEM;
+	info = png_create_info_struct(png);
+	if (!info)
+	{
+		png_destroy_read_struct(&png, NULL, NULL);
+		return -ENOMEM;
+	}
+
+	if (setjmp(png_jmpbuf(png)))
+	{
+		png_destroy_read_struct(&png, &info, NULL);
+		free(rows);
+		return -EINVAL;
+	}
+
+	png_set_read_fn(png, &rd, apng_read);
+	png_set_crc_action(png, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+	png_read_info(png, info);
+	png_set_interlace_handling(png);
+	slide_png_transform(png, info);
+	if (png_get_image_width(png, info) != width || png_get_image_height(png, info) != height)
+		png_error(png, "frame size mismatch");
+
+	rows = malloc(sizeof(*rows) * height);
+	if (!rows)
+		png_error(png, "out of memory");
+	for (j = 0; j < height; j++)
+		rows[j] = out + (size_t)width * 4 * j;
+	png_read_image(png, rows);
+	png_read_end(png, NULL);
+	png_destroy_read_struct(&png, &info, NULL);
+	free(rows);
+
+	for (j = 0; j < height; j++)
+		slide_png_premultiply(out + (size_t)width * 4 * j, width);
+	return 0;
+}
+
+/* @frame, premultiplied BGRA, onto the canvas of @width pixels */
+static void apng_blend(uint8_t *canvas, uint32_t width, const uint8_t *frame, const struct apng_frame *fc)
+{
+	uint32_t w = fc->rect.x2 - fc->rect.x1, h = fc->rect.y2 - fc->rect.y1, x, j, k;
+	uint8_t *d;
+
+	for (j = 0; j < h; j++, frame += (size_t)w * 4)
+	{
+		d = canvas + ((size_t)width * (fc->rect.y1 + j) + fc->rect.x1) * 4;
+		if (fc->blend == APNG_BLEND_SOURCE)
+		{
+			memcpy(d, frame, (size_t)w * 4);
+			continue;
+		}
+		for (x = 0; x < w; x++, d += 4)
+		{
+			for (k = 0; k < 4; k++)
+				d[k] = frame[x * 4 + k] + d[k] * (255 - frame[x * 4 + 3]) / 255;
+		}
+	}
+}
+
+static void apng_clear(uint8_t *canvas, uint32_t width, const struct drm_mode_rect *rect)
+{
+	int32_t j;
+
+	for (j = rect->y1; j < rect->y2; j++)
+		memset(canvas + ((size_t)width * j + rect->x1) * 4, 0, (size_t)(rect->x2 - rect->x1) * 4);
+}
+
+/* true if @path is a PNG with an acTL chunk ahead of its image data */
+static bool png_is_animated(const char *path)
+{
+	uint8_t head[8];
+	bool animated = false;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+
+	if (fread(head, 1, 8, fp) == 8 && !png_sig_cmp(head, 0, 8))
+	{
+		while (fread(head, 1, 8, fp) == 8)
+		{
+			if (!memcmp(head + 4, "acTL", 4))
+				animated = true;
+			if (animated || !memcmp(head + 4, "IDAT", 4) ||
+				fseek(fp, (long)png_be32(head) + 4, SEEK_CUR))
+				break;
+		}
+	}
+
+	fclose(fp);
+	return animated;
+}
+
+/*
+ * Decode an APNG frame by frame. Each frame is reassembled into a
+ * standalone PNG of the frame's size for libpng, composed on a canvas as
+ * the frame asks and packed as a delta limited to the region it changed.
+ */
+static int slide_open_apng(struct slide *slide, const char *path)
+{
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	struct apng_frame fc = { { 0 } }, prev_fc = { { 0 } };
+	struct apng_buf shared = { 0 }, frame = { 0 };
+	uint8_t *file = NULL, *canvas = NULL, *saved = NULL, *image = NULL, ihdr[13];
+	uint32_t width = 0, height = 0, len, num, den, frames = 0;
+	struct drm_mode_rect changed;
+	const uint8_t *p, *end, *data;
+	bool in_frame = false, seen_idat = false;
+	struct stat st;
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -errno;
+	if (fstat(fileno(fp), &st) == 0 && st.st_size > 8 && (file = malloc(st.st_size)))
+		ret = fread(file, 1, st.st_size, fp) == (size_t)st.st_size ? 0 : -EIO;
+	else
+		ret = -ENOMEM;
+	fclose(fp);
+	if (ret)
+		goto out;
+
+	p = file + 8;
+	end = file + st.st_size;
+	while (ret == 0 && end - p >= 12)
+	{
+		len = png_be32(p);
+		data = p + 8;
+		if (len > (size_t)(end - data) - 4)
+		{
+			ret = -EINVAL;
+			break;
+		}
+		p = data + len + 4;
+
+		/* the end of a frame's data, decode and show it */
+		if (in_frame && (!memcmp(data - 4, "fcTL", 4) || !memcmp(data - 4, "IEND", 4)))
+		{
+			in_frame = false;
+			ret = apng_buf_chunk(&frame, "IEND", NULL, 0);
+			if (ret == 0)
+				ret = apng_decode_frame(&frame, image, fc.rect.x2 - fc.rect.x1, fc.rect.y2 - fc.rect.y1);
+			if (ret)
+				break;
+
+			/* the previous frame leaves its region as it asked */
+			if (frames && prev_fc.dispose == APNG_DISPOSE_BACKGROUND)
+				apng_clear(canvas, width, &prev_fc.rect);
+			else if (frames && prev_fc.dispose == APNG_DISPOSE_PREVIOUS)
+				memcpy(canvas, saved, (size_t)width * height * 4);
+			if (fc.dispose == APNG_DISPOSE_PREVIOUS)
+				memcpy(saved, canvas, (size_t)width * height * 4);
+			apng_blend(canvas, width, image, &fc);
+
+			changed = fc.rect;
+			if (frames && prev_fc.dispose != APNG_DISPOSE_NONE)
+			{
+				changed.x1 = prev_fc.rect.x1 < changed.x1 ? prev_fc.rect.x1 : changed.x1;
+				changed.y1 = prev_fc.rect.y1 < changed.y1 ? prev_fc.rect.y1 : changed.y1;
+				changed.x2 = prev_fc.rect.x2 > changed.x2 ? prev_fc.rect.x2 : changed.x2;
+				changed.y2 = prev_fc.rect.y2 > changed.y2 ? prev_fc.rect.y2 : changed.y2;
+			}
+			ret = slide_add_image(slide, canvas, width, height, frames ? &changed : NULL, fc.delay_ns);
+			if (ret)
+				break;
+			prev_fc = fc;
+			frames++;
+		}
+
+		if (!memcmp(data - 4, "IHDR", 4) && len == sizeof(ihdr))
+		{
+			memcpy(ihdr, data, sizeof(ihdr));
+			width = png_be32(data);
+			height = png_be32(data + 4);
+			if (!width || !height || width > 16384 || height > 16384)
+			{
+				ret = -EINVAL;
+				break;
+			}
+			canvas = calloc((size_t)width * height, 4);
+			saved = malloc((size_t)width * height * 4);
+			image = malloc((size_t)width * height * 4);
+			if (!canvas || !saved || !image)
+				ret = -ENOMEM;
+		}
+		else if (!memcmp(data - 4, "acTL", 4) && len == 8)
+		{
+			slide->plays = png_be32(data + 4);
+		}
+		else if (!memcmp(data - 4, "fcTL", 4) && len == 26 && canvas)
+		{
+			fc.rect.x1 = png_be32(data + 12);
+			fc.rect.y1 = png_be32(data + 16);
+			fc.rect.x2 = fc.rect.x1 + png_be32(data + 4);
+			fc.rect.y2 = fc.rect.y1 + png_be32(data + 8);
+			num = data[20] << 8 | data[21];
+			den = data[22] << 8 | data[23];
+			fc.delay_ns = (uint64_t)num * NSEC_PER_SEC / (den ? den : 100);
+			if (fc.delay_ns < ANIM_MIN_DELAY_NS)
+				fc.delay_ns = ANIM_MIN_DELAY_NS;
+			fc.dispose = data[24];
+			fc.blend = data[25];
+			/* the first frame has nothing to keep */
+			if (!frames && fc.dispose == APNG_DISPOSE_PREVIOUS)
+				fc.dispose = APNG_DISPOSE_BACKGROUND;
+			if (png_be32(data + 12) >= width || png_be32(data + 16) >= height ||
+				png_be32(data + 4) > width - (uint32_t)fc.rect.x1 || png_be32(data + 8) > height - (uint32_t)fc.rect.y1 ||
+				fc.rect.x2 == fc.rect.x1 || fc.rect.y2 == fc.rect.y1)
+			{
+				ret = -EINVAL;
+				break;
+			}
+
+			/* the frame's own IHDR, followed by what all frames share */
+			memcpy(ihdr, data + 4, 8);
+			frame.size = 0;
+			ret = apng_buf_append(&frame, signature, sizeof(signature));
+			if (ret == 0)
+				ret = apng_buf_chunk(&frame, "IHDR", ihdr, sizeof(ihdr));
+			if (ret == 0 && shared.size)
+				ret = apng_buf_append(&frame, shared.data, shared.size);
+			in_frame = ret == 0;
+		}
+		else if (!memcmp(data - 4, "IDAT", 4))
+		{
+			/* without an fcTL first the default image is not part of the animation */
+			seen_idat = true;
+			if (in_frame)
+				ret = apng_buf_chunk(&frame, "IDAT", data, len);
+		}
+		else if (!memcmp(data - 4, "fdAT", 4) && len > 4)
+		{
+			if (in_frame)
+				ret = apng_buf_chunk(&frame, "IDAT", data + 4, len - 4);
+		}
+		else if (!seen_idat && memcmp(data - 4, "IEND", 4))
+		{
+			/* PLTE, tRNS, gAMA and friends apply to every frame */
+			ret = apng_buf_append(&shared, data - 8, (size_t)len + 12);
+		}
+	}
+
+	if (ret == 0 && !frames)
+		ret = -EINVAL;
+
+out:
+	if (ret)
+		fprintf(stderr, "cannot decode APNG '%s' (%d)\n", path, ret);
+	free(file);
+	free(canvas);
+	free(saved);
+	free(image);
+	free(shared.data);
+	free(frame.data);
+	return ret;
+}
+
+/* a still image, an APNG or a directory of frames */
+static int slide_open(struct slide *slide, const char *path)
+{
+	struct stat st;
+	int ret;
+
+	if (stat(path, &st))
+		return -errno;
+	if (S_ISDIR(st.st_mode))
+		ret = slide_open_dir(slide, path);
+	else if (png_is_animated(path))
+		ret = slide_open_apng(slide, path);
+	else
+	{
+		ret = slide_load(slide, path);
+		if (ret == 0)
+			ret = slide_pack_frame(slide, NULL, 0);
+	}
+
+	if (ret)
+		slide_release(slide);
+	else
+		slide_pack_done(slide);
+	return ret;
+}
+
+/*
+ * A slide converted ahead of time, XRGB8888 at width x height without
+ * rotation: packed tiles as slide_pack_frame() makes them, or raw pixels
+ * when tiles is NULL. 'make EMBED=IMAGE' builds one into the binary with
+ * embed_generate().
+ */
+struct slide_asset
+{
+	uint32_t width;
+	uint32_t height;
+	const uint64_t *tiles;
+	const struct packed_tile *pack;
+	/* followed by PACK_SLACK bytes the unpacker may read */
+	const uint8_t *data;
+	size_t size;
+};
+
+#ifdef EMBEDDED_SPLASH
+#include EMBEDDED_SPLASH
+#endif
+
+/*
+ * Open @asset as a slide. Packed for this very buffer, its tiles are
+ * copied as they are and nothing is decoded; other sizes, formats and
+ * rotations unpack the pixels and take the way of a decoded file.
+ */
+static int slide_open_asset(struct slide *slide, const struct slide_asset *asset)
+{
+	uint32_t tiles_x, tiles_y, tx, ty, w, h, j, i;
+	uint8_t tile[TILE_SIZE * TILE_SIZE * 4 + PACK_SLACK], *pixels = NULL;
+	const uint8_t *src = asset->data;
+	struct resample rs;
+	struct slide xrgb;
+	size_t count;
+	int ret;
+
+	tiles_x = (asset->width + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (asset->height + TILE_SIZE - 1) / TILE_SIZE;
+	count = (size_t)tiles_x * tiles_y;
+
+	if (asset->tiles && slide->width == asset->width && slide->height == asset->height &&
+		slide->format == DRM_FORMAT_XRGB8888 && rotation_is_identity(slide->rotation))
+	{
+		slide->frames = calloc(1, sizeof(*slide->frames));
+		if (!slide->frames)
+			return -ENOMEM;
+		slide->frame_count = 1;
+		slide->frames->tiles = malloc(sizeof(*slide->frames->tiles) * count);
+		slide->frames->pack = malloc(sizeof(*slide->frames->pack) * count);
+		slide->packed = malloc(asset->size + PACK_SLACK);
+		if (!slide->frames->tiles || !slide->frames->pack || !slide->packed)
+		{
+			slide_release(slide);
+			return -ENOMEM;
+		}
+		memcpy(slide->frames->tiles, asset->tiles, sizeof(*slide->frames->tiles) * count);
+		memcpy(slide->frames->pack, asset->pack, sizeof(*slide->frames->pack) * count);
+		memcpy(slide->packed, asset->data, asset->size + PACK_SLACK);
+		slide->packed_size = asset->size;
+		slide->packed_cap = asset->size + PACK_SLACK;
+		return 0;
+	}
+
+	if (asset->tiles)
+	{
+		pixels = malloc((size_t)asset->width * asset->height * 4);
+		if (!pixels)
+			return -ENOMEM;
+		for (ty = 0, i = 0; ty < tiles_y; ty++)
+		{
+			h = asset->height - ty * TILE_SIZE < TILE_SIZE ? asset->height - ty * TILE_SIZE : TILE_SIZE;
+			for (tx = 0; tx < tiles_x; tx++, i++)
+			{
+				w = asset->width - tx * TILE_SIZE < TILE_SIZE ? asset->width - tx * TILE_SIZE : TILE_SIZE;
+				if (tile_unpack(tile, (size_t)w * h * 4, asset->data + asset->pack[i].offset,
+								asset->data + asset->pack[i].offset + asset->pack[i].size, 4))
+				{
+					free(pixels);
+					return -EINVAL;
+				}
+				for (j = 0; j < h; j++)
+					memcpy(pixels + ((size_t)asset->width * (ty * TILE_SIZE + j) + tx * TILE_SIZE) * 4,
+						   tile + w * 4 * j, w * 4);
+			}
+		}
+		src = pixels;
+	}
+
+	ret = slide_canvas(slide, &xrgb);
+	if (ret == 0)
+	{
+		ret = slide_resample_init(&xrgb, &rs, asset->width, asset->height);
+		if (ret == 0)
+		{
+			for (j = 0; j < asset->height; j++)
+				resample_push_row(&rs, src + (size_t)asset->width * 4 * j);
+			resample_free(&rs);
+			ret = slide_finish(slide, &xrgb);
+		}
+		free(xrgb.data);
+	}
+	free(pixels);
+
+	if (ret == 0)
+		ret = slide_pack_frame(slide, NULL, 0);
+	if (ret)
+		slide_release(slide);
+	else
+		slide_pack_done(slide);
+	return ret;
+}
+
+/* drop least recently used slides until @need more bytes fit the budget */
+static void slide_evict(size_t need)
+{
+	struct slide **iter, **lru, *victim;
+
+	while (slide_cache_size + need > slide_budget)
+	{
+		lru = NULL;
+		for (iter = &slide_list; *iter; iter = &(*iter)->next)
+		{
+			if ((*iter)->frame_count && (*iter)->last_used < slide_pinned && (!lru || (*iter)->last_used < (*lru)->last_used))
+				lru = iter;
+		}
+		if (!lru)
+			return;
+
+		fprintf(stderr, "evicting slide %u (%zu kB)\n", (*lru)->index, slide_footprint(*lru) / 1024);
+		slide_cache_size -= slide_footprint(*lru);
+		victim = *lru;
+		*lru = victim->next;
+		slide_free(victim);
+	}
+}
+
+static const char *const slide_exts[] = { "png", "apng", "jpg", "jpeg", "anim" };
+
+static bool slide_file_exists(unsigned int index)
+{
+	char path[64];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(slide_exts) / sizeof(slide_exts[0]); i++)
+	{
+		snprintf(path, sizeof(path), BOOT_IMAGE_PATTERN, index, slide_exts[i]);
+		if (access(path, R_OK) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* decoded slides are kept packed within the budget, NULL if missing */
+static struct slide *slide_get(unsigned int index, const struct modeset_buf *buf, uint32_t rotation)
+{
+	struct slide *iter, **link;
+	char path[64];
+	unsigned int i;
+	uint64_t start;
+
+	for (link = &slide_list; (iter = *link); link = &iter->next)
+	{
+		if (iter->index == index && iter->width == buf->width && iter->height == buf->height &&
+			iter->format == buf->format && iter->rotation == rotation)
+		{
+			/* a stand-in makes way once the file is there, unless another output draws it this frame */
+			if (iter->standin_ns && iter->last_used < slide_pinned && get_time_ns() >= iter->standin_ns)
+			{
+				if (slide_file_exists(index))
+				{
+					*link = iter->next;
+					slide_cache_size -= slide_footprint(iter);
+					slide_free(iter);
+					break;
+				}
+				iter->standin_ns = get_time_ns() + STANDIN_RETRY_NS;
+			}
+			iter->last_used = ++slide_clock;
+			return iter;
+		}
+	}
+
+	iter = calloc(1, sizeof(*iter));
+	if (!iter)
+		return NULL;
+
+	iter->index = index;
+	iter->width = buf->width;
+	iter->height = buf->height;
+	/* tiles are copied row by row, the decode stride need not be the pitch */
+	iter->stride = buf->width * (pixel_format_get(buf->format)->bpp / 8);
+	iter->format = buf->format;
+	iter->rotation = rotation;
+	iter->last_used = ++slide_clock;
+
+	start = get_time_ns();
+	for (i = 0; i < sizeof(slide_exts) / sizeof(slide_exts[0]); i++)
+	{
+		snprintf(path, sizeof(path), BOOT_IMAGE_PATTERN, index, slide_exts[i]);
+		if (slide_open(iter, path) == 0)
+			break;
+	}
+#ifdef EMBEDDED_SPLASH
+	/* early in boot /etc may not even be mounted yet */
+	if (!iter->frame_count && index == BOOT_IMAGE_FIRST && slide_open_asset(iter, &embedded_splash) == 0)
+	{
+		snprintf(path, sizeof(path), "built-in splash");
+		iter->standin_ns = get_time_ns() + STANDIN_RETRY_NS;
+	}
+#endif
+	/* the file may still show up on a late mount or be written later */
+	if (!iter->frame_count)
+	{
+		if (index != slide_missing)
+			fprintf(stderr, "cannot load slide %u\n", index);
+		slide_missing = index;
+		slide_free(iter);
+		return NULL;
+	}
+
+	fprintf(stderr, "slide '%s' decoded for %ux%u in %.1f ms, %u frames packed %.1f:1 to %zu kB, peak RSS %ld kB\n",
+			path, iter->width, iter->height, (get_time_ns() - start) / 1e6, iter->frame_count,
+			(double)iter->stride * iter->height * iter->frame_count / iter->packed_size,
+			iter->packed_size / 1024, rss_read_kb("VmHWM:"));
+	slide_missing = UINT_MAX;
+	slide_evict(slide_footprint(iter));
+	slide_cache_size += slide_footprint(iter);
+
+	iter->next = slide_list;
+	slide_list = iter;
+	return iter;
+}
+
+/*
+ * Frame of an animation started at @start to show at @when. Returns the
+ * frame number counted across loops, @index is its frame in the slide,
+ * @due when it should have come up and @next when the following one does
+ * (0 once the animation has stopped).
+ */
+static uint64_t slide_frame_at(const struct slide *slide, uint64_t start, uint64_t when,
+							   unsigned int *index, uint64_t *due, uint64_t *next)
+{
+	uint64_t t = when > start ? when - start : 0, loop;
+	unsigned int lo = 0, hi = slide->frame_count - 1, mid;
+
+	loop = t / slide->duration_ns;
+	if (slide->plays && loop >= slide->plays)
+	{
+		*index = slide->frame_count - 1;
+		loop = slide->plays - 1;
+		*due = start + loop * slide->duration_ns + slide->frames[*index].start_ns;
+		*next = 0;
+		return loop * slide->frame_count + *index;
+	}
+
+	t -= loop * slide->duration_ns;
+	while (lo < hi)
+	{
+		mid = (lo + hi + 1) / 2;
+		if (slide->frames[mid].start_ns <= t)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	*index = lo;
+	*due = start + loop * slide->duration_ns + slide->frames[lo].start_ns;
+	*next = *due + slide->frames[lo].delay_ns;
+	if (slide->plays && loop == slide->plays - 1 && lo == slide->frame_count - 1)
+		*next = 0;
+	return loop * slide->frame_count + lo;
+}
+
+static void slide_cache_free(void)
+{
+	struct slide *iter;
+
+	while (slide_list)
+	{
+		iter = slide_list;
+		slide_list = iter->next;
+		slide_free(iter);
+	}
+	slide_cache_size = 0;
+}
+
+/* workers besides the event loop thread, which takes part in every job */
+#define RENDER_THREADS_MAX 7
+/* outputs with at least this many pixels are drawn in one band per thread */
+#define RENDER_BAND_PIXELS (1280 * 720)
+#define RENDER_STACK_SIZE (256 << 10)
+
+typedef void (*render_fn)(void *arg, unsigned int index);
+
+/*
+ * A fixed pool that runs fn(arg, 0..count-1) and returns once all of them
+ * are done, so whatever follows (the commit) sees finished pixels. Jobs
+ * started from inside a job run inline.
+ */
+static struct render_pool
+{
+	pthread_t threads[RENDER_THREADS_MAX];
+	unsigned int threads_count;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	render_fn fn;
+	void *arg;
+	unsigned int next;
+	unsigned int count;
+	unsigned int finished;
+	bool quit;
+} render_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER,
+				  .done = PTHREAD_COND_INITIALIZER };
+
+/* -1 picks one worker per additional online CPU */
+static int render_threads = -1;
+static __thread bool render_in_job;
+
+/* take and run indices of the current job until none are left, called with the lock held */
+static void render_pool_drain(void)
+{
+	unsigned int index;
+
+	while (render_pool.next < render_pool.count)
+	{
+		index = render_pool.next++;
+		pthread_mutex_unlock(&render_pool.lock);
+		render_pool.fn(render_pool.arg, index);
+		pthread_mutex_lock(&render_pool.lock);
+		if (++render_pool.finished == render_pool.count)
+			pthread_cond_signal(&render_pool.done);
+	}
+}
+
+static void *render_worker(void *data)
+{
+	render_in_job = true;
+	pthread_mutex_lock(&render_pool.lock);
+	while (!render_pool.quit)
+	{
+		render_pool_drain();
+		pthread_cond_wait(&render_pool.work, &render_pool.lock);
+	}
+	pthread_mutex_unlock(&render_pool.lock);
+	return NULL;
+}
+
+static void render_run(render_fn fn, void *arg, unsigned int count)
+{
+	unsigned int i;
+
+	if (!render_pool.threads_count || render_in_job || count < 2)
+	{
+		for (i = 0; i < count; i++)
+			fn(arg, i);
+		return;
+	}
+
+	pthread_mutex_lock(&render_pool.lock);
+	render_pool.fn = fn;
+	render_pool.arg = arg;
+	render_pool.next = 0;
+	render_pool.finished = 0;
+	render_pool.count = count;
+	pthread_cond_broadcast(&render_pool.work);
+
+	render_in_job = true;
+	render_pool_drain();
+	render_in_job = false;
+	while (render_pool.finished < render_pool.count)
+		pthread_cond_wait(&render_pool.done, &render_pool.lock);
+	render_pool.count = 0;
+	pthread_mutex_unlock(&render_pool.lock);
+}
+
+/* workers inherit the scheduling policy, start them after realtime_enter() */
+static void render_pool_start(int threads)
+{
+	pthread_attr_t attr;
+	long cpus;
+
+	if (threads < 0)
+	{
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 1 ? cpus - 1 : 0;
+	}
+	if (threads > RENDER_THREADS_MAX)
+		threads = RENDER_THREADS_MAX;
+
+	render_pool.quit = false;
+	pthread_attr_init(&attr);
+	/* real-time mode locks the whole stack of every thread */
+	pthread_attr_setstacksize(&attr, RENDER_STACK_SIZE);
+	for (render_pool.threads_count = 0; render_pool.threads_count < (unsigned int)threads; render_pool.threads_count++)
+	{
+		if (pthread_create(&render_pool.threads[render_pool.threads_count], &attr, render_worker, NULL))
+		{
+			fprintf(stderr, "cannot start render worker (%d):%m\n", errno);
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void render_pool_stop(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&render_pool.lock);
+	render_pool.quit = true;
+	pthread_cond_broadcast(&render_pool.work);
+	pthread_mutex_unlock(&render_pool.lock);
+
+	for (i = 0; i < render_pool.threads_count; i++)
+		pthread_join(render_pool.threads[i], NULL);
+	render_pool.threads_count = 0;
+}
+
+struct render_band
+{
+	void (*fn)(void *arg, uint32_t first, uint32_t end);
+	void *arg;
+	uint32_t rows;
+	unsigned int bands;
+};
+
+static void render_band_task(void *arg, unsigned int index)
+{
+	struct render_band *band = arg;
+
+	band->fn(band->arg, (uint64_t)band->rows * index / band->bands, (uint64_t)band->rows * (index + 1) / band->bands);
+}
+
+/* fn(arg, first, end) over @rows rows, split in bands when the output of @pixels is large */
+static void render_rows(void (*fn)(void *arg, uint32_t first, uint32_t end), void *arg, uint32_t rows, uint64_t pixels)
+{
+	struct render_band band = { fn, arg, rows, render_pool.threads_count + 1 };
+
+	if (band.bands > rows)
+		band.bands = rows;
+	if (pixels < RENDER_BAND_PIXELS || render_in_job || band.bands < 2)
+	{
+		fn(arg, 0, rows);
+		return;
+	}
+	render_run(render_band_task, &band, band.bands);
+}
+
+/*
+ * The pixels of @buf an upright @width x @height frame covers once the
+ * software @rotation turned it, cropped to the buffer like the overlays.
+ */
+static struct drm_mode_rect modeset_frame_rect(const struct modeset_buf *buf, uint32_t rotation,
+											   uint32_t width, uint32_t height)
+{
+	const struct orient o = orient_get(rotation);
+	uint32_t w = o.transpose ? buf->height : buf->width, h = o.transpose ? buf->width : buf->height;
+	struct drm_mode_rect rect;
+
+	w = width < w ? width : w;
+	h = height < h ? height : h;
+	if (o.transpose)
+	{
+		uint32_t t = w;
+
+		w = h;
+		h = t;
+	}
+	rect.x1 = o.flip_x ? buf->width - w : 0;
+	rect.y1 = o.flip_y ? buf->height - h : 0;
+	rect.x2 = rect.x1 + w;
+	rect.y2 = rect.y1 + h;
+	return rect;
+}
+
+struct blit_band
+{
+	struct modeset_buf *buf;
+	const uint8_t *src;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	/* with a software rotation, turned into @rect of the buffer */
+	uint32_t rotation;
+	struct drm_mode_rect rect;
+	bool nv12;
+};
+
+static void modeset_blit_xrgb_rows(void *arg, uint32_t first, uint32_t end)
+{
+	const struct blit_band *b = arg;
+	uint32_t j;
+
+	for (j = first; j < end; ++j)
+		convert_row(b->buf->format, &b->buf->map[b->buf->stride * j], (const uint32_t *)&b->src[b->stride * j],
+					b->width, j);
+}
+
+/* source rows [first, end) of an XRGB8888 frame rotated straight into an XRGB8888 buffer */
+static void modeset_blit_rotate_rows(void *arg, uint32_t first, uint32_t end)
+{
+	const struct blit_band *b = arg;
+	const struct orient o = orient_get(b->rotation);
+	uint32_t rw = b->rect.x2 - b->rect.x1, rh = b->rect.y2 - b->rect.y1, x = 0, y = 0;
+
+	/* the band is a strip of the rectangle, a column strip when transposed */
+	if (o.transpose)
+		x = o.flip_x ? rw - end : first;
+	else
+		y = o.flip_y ? rh - end : first;
+	rotate_xrgb((uint32_t *)&b->buf->map[(size_t)b->buf->stride * (b->rect.y1 + y) + (b->rect.x1 + x) * 4],
+				b->buf->stride / 4, (const uint32_t *)&b->src[(size_t)b->stride * first],
+				o.transpose ? rh : rw, end - first, b->stride / 4, b->rotation);
+}
+
+static inline uint32_t yuv_to_xrgb(int y, int u, int v)
+{
+	int r, g, b;
+
+	/* BT.601 limited range, 8 bit fixed point */
+	y = (y - 16) * 298;
+	r = (y + 409 * v + 128) >> 8;
+	g = (y - 100 * u - 208 * v + 128) >> 8;
+	b = (y + 516 * u + 128) >> 8;
+
+	r = r < 0 ? 0 : r > 255 ? 255 : r;
+	g = g < 0 ? 0 : g > 255 ? 255 : g;
+	b = b < 0 ? 0 : b > 255 ? 255 : b;
+	return (r << 16) | (g << 8) | b;
+}
+
+/* rows [first, end) of @rect gathered through the rotation, for other formats and NV12 */
+static void modeset_blit_turned_rows(void *arg, uint32_t first, uint32_t end)
+{
+	const struct blit_band *b = arg;
+	const struct orient o = orient_get(b->rotation);
+	struct modeset_buf *buf = b->buf;
+	uint32_t bpp = pixel_format_get(buf->format)->bpp / 8;
+	uint32_t rw = b->rect.x2 - b->rect.x1, rh = b->rect.y2 - b->rect.y1;
+	uint32_t row[buf->width], *dst, px, py, x, y, sx, sy;
+	const uint8_t *chroma;
+	uint8_t *out;
+
+	for (py = first; py < end; py++)
+	{
+		out = &buf->map[(size_t)buf->stride * (b->rect.y1 + py) + b->rect.x1 * bpp];
+		dst = buf->format == DRM_FORMAT_XRGB8888 ? (uint32_t *)out : row;
+		y = o.flip_y ? rh - 1 - py : py;
+		for (px = 0; px < rw; px++)
+		{
+			x = o.flip_x ? rw - 1 - px : px;
+			sx = o.transpose ? y : x;
+			sy = o.transpose ? x : y;
+			if (b->nv12)
+			{
+				chroma = b->src + (size_t)b->width * b->height + (size_t)b->width * (sy / 2);
+				dst[px] = yuv_to_xrgb(b->src[(size_t)b->width * sy + sx], chroma[sx & ~1u] - 128,
+									  chroma[sx | 1u] - 128);
+			}
+			else
+			{
+				dst[px] = *(const uint32_t *)&b->src[(size_t)b->stride * sy + sx * 4];
+			}
+		}
+		if (dst == row)
+			convert_row(buf->format, out, row, rw, b->rect.y1 + py);
+	}
+}
+
+/* a frame turned by the software @rotation, see modeset_frame_rect() */
+static void modeset_blit_rotated(struct blit_band *band, uint32_t rotation)
+{
+	const struct orient o = orient_get(rotation);
+	uint64_t pixels;
+
+	band->rotation = rotation;
+	band->rect = modeset_frame_rect(band->buf, rotation, band->width, band->height);
+	pixels = (uint64_t)(band->rect.x2 - band->rect.x1) * (band->rect.y2 - band->rect.y1);
+	if (band->nv12 || band->buf->format != DRM_FORMAT_XRGB8888)
+		render_rows(modeset_blit_turned_rows, band, band->rect.y2 - band->rect.y1, pixels);
+	else
+		render_rows(modeset_blit_rotate_rows, band,
+					o.transpose ? band->rect.x2 - band->rect.x1 : band->rect.y2 - band->rect.y1, pixels);
+}
+
+/*
+ * Copy an XRGB8888 image into @buf, cropped to the buffer size, turned
+ * by the software @rotation and converted to its format.
+ */
+static void modeset_blit_xrgb(struct modeset_buf *buf, const uint8_t *src,
+							  uint32_t width, uint32_t height, uint32_t stride, uint32_t rotation)
+{
+	struct blit_band band = { buf, src, width, height, stride };
+
+	if (!rotation_is_identity(rotation))
+	{
+		modeset_blit_rotated(&band, rotation);
+		return;
+	}
+
+	if (band.width > buf->width)
+		band.width = buf->width;
+	if (band.height > buf->height)
+		band.height = buf->height;
+
+	render_rows(modeset_blit_xrgb_rows, &band, band.height, (uint64_t)band.width * band.height);
+}
+
+static void modeset_blit_nv12_rows(void *arg, uint32_t first, uint32_t end)
+{
+	const struct blit_band *b = arg;
+	struct modeset_buf *buf = b->buf;
+	const uint8_t *luma, *chroma;
+	uint32_t *dst, w, j, k;
+	uint32_t row[buf->width];
+	int u, v;
+
+	w = b->width < buf->width ? b->width : buf->width;
+
+	for (j = first; j < end; ++j)
+	{
+		luma = b->src + (size_t)b->width * j;
+		chroma = b->src + (size_t)b->width * b->height + (size_t)b->width * (j / 2);
+		dst = buf->format == DRM_FORMAT_XRGB8888 ? (uint32_t *)&buf->map[buf->stride * j] : row;
+
+		for (k = 0; k < w; ++k)
+		{
+			u = chroma[k & ~1u] - 128;
+			v = chroma[k | 1u] - 128;
+			dst[k] = yuv_to_xrgb(luma[k], u, v);
+		}
+
+		if (dst == row)
+			convert_row(buf->format, &buf->map[buf->stride * j], row, w, j);
+	}
+}
+
+/* convert an NV12 image into @buf, cropped to the buffer size and turned by @rotation */
+static void modeset_blit_nv12(struct modeset_buf *buf, const uint8_t *src,
+							  uint32_t width, uint32_t height, uint32_t rotation)
+{
+	struct blit_band band = { buf, src, width, height, width };
+	uint32_t h = height < buf->height ? height : buf->height;
+
+	if (!rotation_is_identity(rotation))
+	{
+		band.nv12 = true;
+		modeset_blit_rotated(&band, rotation);
+		return;
+	}
+
+	render_rows(modeset_blit_nv12_rows, &band, h, (uint64_t)width * h);
+}
+
+/* draw the newest complete stream frame, see modeset_prepare_frame() */
+static void modeset_draw_stream(struct modeset_buf *buf, uint32_t rotation)
+{
+	if (stream.format == DRM_FORMAT_NV12)
+		modeset_blit_nv12(buf, stream.ready, stream.width, stream.height, rotation);
+	else
+		modeset_blit_xrgb(buf, stream.ready, stream.width, stream.height, stream.width * 4, rotation);
+}
+
+struct base_band
+{
+	struct modeset_buf *buf;
+	const struct slide *slide;
+	unsigned int frame;
+	const struct background_geom *bg;
+	const struct drm_mode_rect *cover;
+	size_t written;
+};
+
+/* tile @tx, @ty lies entirely inside @cover, which a frame blitted next overwrites */
+static inline bool tile_hidden(const struct modeset_buf *buf, const struct drm_mode_rect *cover,
+							   uint32_t tx, uint32_t ty)
+{
+	int32_t x = tx * TILE_SIZE, y = ty * TILE_SIZE;
+
+	return cover && x >= cover->x1 && y >= cover->y1 &&
+		   (x + TILE_SIZE < (int32_t)buf->width ? x + TILE_SIZE : (int32_t)buf->width) <= cover->x2 &&
+		   (y + TILE_SIZE < (int32_t)buf->height ? y + TILE_SIZE : (int32_t)buf->height) <= cover->y2;
+}
+
+/*
+ * Tiles of row @ty without a slide get black or the background. Runs of
+ * them are written a pixel row at a time, one sequential pass instead of
+ * a tile after the other, which matters when all of a 4K frame changes.
+ */
+static size_t modeset_draw_empty(struct modeset_buf *buf, const struct background_geom *bg,
+								 const struct drm_mode_rect *cover, uint32_t ty)
+{
+	uint32_t bpp = pixel_format_get(buf->format)->bpp / 8;
+	uint32_t y = ty * TILE_SIZE, h, tx, start, x, w, j;
+	uint64_t tag = bg ? background_tile_tag(TILE_BLACK, bg) : TILE_BLACK;
+	uint64_t *tiles = &buf->tiles[ty * buf->tiles_x];
+	uint32_t row[buf->width];
+	size_t written = 0;
+	uint8_t *dst;
+
+	h = buf->height - y < TILE_SIZE ? buf->height - y : TILE_SIZE;
+	for (tx = 0; tx < buf->tiles_x;)
+	{
+		if (tiles[tx] == tag || tile_hidden(buf, cover, tx, ty))
+		{
+			tx++;
+			continue;
+		}
+		for (start = tx; tx < buf->tiles_x && tiles[tx] != tag && !tile_hidden(buf, cover, tx, ty); tx++)
+			tiles[tx] = tag;
+
+		x = start * TILE_SIZE;
+		w = (tx * TILE_SIZE < buf->width ? tx * TILE_SIZE : buf->width) - x;
+		for (j = 0; j < h; j++)
+		{
+			dst = buf->map + (size_t)buf->stride * (y + j) + x * bpp;
+			/* black is all zero bits in every format we scan out */
+			if (!bg)
+			{
+				memset(dst, 0, w * bpp);
+			}
+			else if (buf->format == DRM_FORMAT_XRGB8888)
+			{
+				background_row(bg, (uint32_t *)dst, x, y + j, w);
+			}
+			else
+			{
+				background_row(bg, row, x, y + j, w);
+				convert_row(buf->format, dst, row, w, y + j);
+			}
+		}
+		written += (size_t)w * bpp * h;
+	}
+	return written;
+}
+
+static void modeset_draw_base_rows(void *arg, uint32_t first, uint32_t end)
+{
+	struct base_band *band = arg;
+	struct modeset_buf *buf = band->buf;
+	const struct slide *slide = band->slide;
+	const unsigned int frame = band->frame;
+	const struct packed_tile *pack = slide ? slide->frames[frame].pack : NULL;
+	const struct background_geom *bg = band->bg;
+	uint32_t bpp = pixel_format_get(buf->format)->bpp / 8;
+	uint8_t tile[TILE_SIZE * TILE_SIZE * 4 + PACK_SLACK], under[TILE_SIZE * 4], *dst;
+	uint32_t row[TILE_SIZE];
+	uint32_t tx, ty, x, y, w, h, j, i;
+	size_t written = 0;
+	uint64_t tag;
+	bool clear;
+
+	for (ty = first; ty < end; ty++)
+	{
+		if (!slide)
+		{
+			written += modeset_draw_empty(buf, bg, band->cover, ty);
+			continue;
+		}
+
+		y = ty * TILE_SIZE;
+		h = buf->height - y < TILE_SIZE ? buf->height - y : TILE_SIZE;
+		for (tx = 0; tx < buf->tiles_x; tx++)
+		{
+			i = ty * buf->tiles_x + tx;
+			tag = slide->frames[frame].tiles[i];
+			/* the background shows through transparent pixels of the slide */
+			clear = bg && pack[i].see_through;
+			if (clear)
+				tag = background_tile_tag(tag, bg);
+			if (buf->tiles[i] == tag || tile_hidden(buf, band->cover, tx, ty))
+				continue;
+
+			x = tx * TILE_SIZE;
+			w = buf->width - x < TILE_SIZE ? buf->width - x : TILE_SIZE;
+			if (tile_unpack(tile, (size_t)w * h * bpp, slide->packed + pack[i].offset,
+							slide->packed + pack[i].offset + pack[i].size, bpp))
+			{
+				fprintf(stderr, "corrupt tile %u of slide %u\n", i, slide->index);
+				tag = TILE_UNKNOWN;
+			}
+
+			for (j = 0; j < h; j++)
+			{
+				dst = buf->map + (size_t)buf->stride * (y + j) + x * bpp;
+				if (tag == TILE_UNKNOWN)
+				{
+					memset(dst, 0, w * bpp);
+				}
+				else if (!clear)
+				{
+					memcpy(dst, tile + (size_t)w * bpp * j, w * bpp);
+				}
+				else
+				{
+					background_row(bg, row, x, y + j, w);
+					if (buf->format != DRM_FORMAT_XRGB8888)
+						convert_row(buf->format, under, row, w, y + j);
+					background_under(dst, tile + (size_t)w * bpp * j,
+									 buf->format == DRM_FORMAT_XRGB8888 ? (const uint8_t *)row : under,
+									 slide->packed + pack[i].offset + pack[i].size, w * j, w, bpp);
+				}
+			}
+			written += (size_t)w * bpp * h;
+			buf->tiles[ty * buf->tiles_x + tx] = tag;
+		}
+	}
+	__atomic_fetch_add(&band->written, written, __ATOMIC_RELAXED);
+}
+
+/*
+ * Bring every tile of @buf to the slide it should show, over the
+ * background @bg or black if that is NULL. Only tiles whose tag differs
+ * are written, and none that lie inside @cover, returns the bytes written.
+ */
+static size_t modeset_draw_base(struct modeset_buf *buf, const struct slide *slide, unsigned int frame,
+								const struct background_geom *bg, const struct drm_mode_rect *cover)
+{
+	struct base_band band = { buf, slide, frame, bg, cover, 0 };
+
+	render_rows(modeset_draw_base_rows, &band, buf->tiles_y, (uint64_t)buf->width * buf->height);
+	return band.written;
+}
+
+/* something drew over these framebuffer pixels, their tiles no longer match a tag */
+static void modeset_mark_tiles(struct modeset_buf *buf, int x1, int y1, int x2, int y2)
+{
+	int tx, ty;
+
+	x1 = x1 < 0 ? 0 : x1;
+	y1 = y1 < 0 ? 0 : y1;
+	x2 = x2 > (int)buf->width ? (int)buf->width : x2;
+	y2 = y2 > (int)buf->height ? (int)buf->height : y2;
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	for (ty = y1 / TILE_SIZE; ty <= (y2 - 1) / TILE_SIZE; ty++)
+		for (tx = x1 / TILE_SIZE; tx <= (x2 - 1) / TILE_SIZE; tx++)
+			buf->tiles[ty * buf->tiles_x + tx] = TILE_UNKNOWN;
+}
+
+/* same for a rectangle in cairo user space, with a margin for antialiasing */
+static void modeset_mark_user(cairo_t *cr, struct modeset_buf *buf, double x, double y, double w, double h)
+{
+	double px[4] = { x, x + w, x, x + w }, py[4] = { y, y, y + h, y + h };
+	double x1 = INFINITY, y1 = INFINITY, x2 = -INFINITY, y2 = -INFINITY;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		cairo_user_to_device(cr, &px[i], &py[i]);
+		x1 = fmin(x1, px[i]);
+		y1 = fmin(y1, py[i]);
+		x2 = fmax(x2, px[i]);
+		y2 = fmax(y2, py[i]);
+	}
+	modeset_mark_tiles(buf, floor(x1) - 2, floor(y1) - 2, ceil(x2) + 2, ceil(y2) + 2);
+}
+
+/*
+ * Tiles that may differ from the front buffer, merged into row runs and
+ * grown downwards, become the FB_DAMAGE_CLIPS of the next flip.
+ */
+static void modeset_collect_damage(struct modeset_device *dev, const struct modeset_buf *buf,
+								   const struct modeset_buf *front)
+{
+	struct drm_mode_rect rect;
+	uint32_t tx, ty, start, i;
+	uint64_t tag;
+
+	dev->damage_count = 0;
+	for (ty = 0; ty < buf->tiles_y; ty++)
+	{
+		for (tx = 0; tx < buf->tiles_x;)
+		{
+			tag = buf->tiles[ty * buf->tiles_x + tx];
+			if (tag != TILE_UNKNOWN && tag == front->tiles[ty * buf->tiles_x + tx])
+			{
+				tx++;
+				continue;
+			}
+
+			for (start = tx++; tx < buf->tiles_x; tx++)
+			{
+				tag = buf->tiles[ty * buf->tiles_x + tx];
+				if (tag != TILE_UNKNOWN && tag == front->tiles[ty * buf->tiles_x + tx])
+					break;
+			}
+
+			rect.x1 = start * TILE_SIZE;
+			rect.y1 = ty * TILE_SIZE;
+			rect.x2 = tx * TILE_SIZE < buf->width ? tx * TILE_SIZE : buf->width;
+			rect.y2 = (ty + 1) * TILE_SIZE < buf->height ? (ty + 1) * TILE_SIZE : buf->height;
+
+			for (i = 0; i < dev->damage_count; i++)
+			{
+				if (dev->damage[i].x1 == rect.x1 && dev->damage[i].x2 == rect.x2 &&
+					dev->damage[i].y2 == rect.y1)
+					break;
+			}
+			if (i < dev->damage_count)
+			{
+				dev->damage[i].y2 = rect.y2;
+			}
+			else if (dev->damage_count < DAMAGE_MAX)
+			{
+				dev->damage[dev->damage_count++] = rect;
+			}
+			else
+			{
+				/* too fragmented, damage everything */
+				dev->damage[0] = (struct drm_mode_rect){ 0, 0, buf->width, buf->height };
+				dev->damage_count = 1;
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * Pick what the next frame of @dev shows. Everything shared between
+ * outputs (slide cache, stream and animation state) is touched here, on the
+ * event loop thread, so modeset_render_frame() can run on any worker.
+ */
+static void modeset_prepare_frame(struct modeset_device *dev)
+{
+	struct modeset_buf *buf = &dev->bufs[dev->front_buf ^ 1];
+	struct slide *slide;
+	unsigned int frame = 0;
+
+	/* content is chosen for the time the frame hits the screen, not for now */
+	dev->draw_countdown = splash_countdown_at(dev->present_ns);
+	dev->bg_next_ns = background_at(dev->present_ns, &dev->bg_from, &dev->bg_to);
+	slide = NULL;
+	if (!dev->draw_countdown && !splash.frame_map && !stream.has_ready)
+		slide = slide_get(splash.slide, buf, dev->sw_rotation);
+
+	/* animations start when they first come up and are paced by the flips */
+	dev->anim_next_ns = 0;
+	dev->anim_pending = false;
+	if (slide && slide->frame_count > 1)
+	{
+		if ((int)slide->index != dev->anim_slide)
+		{
+			dev->anim_slide = slide->index;
+			dev->anim_start_ns = dev->present_ns;
+			dev->anim_shown = -1;
+		}
+		dev->anim_pending_n = slide_frame_at(slide, dev->anim_start_ns, dev->present_ns, &frame,
+											 &dev->anim_pending_due, &dev->anim_next_ns);
+		dev->anim_pending = true;
+	}
+	else
+	{
+		dev->anim_slide = -1;
+	}
+
+	dev->standin_ns = slide ? slide->standin_ns : 0;
+	if (slide && !dev->first_slide_ns)
+	{
+		dev->first_slide_pending = true;
+		dev->first_slide_standin = slide->standin_ns != 0;
+	}
+
+	dev->draw_slide = slide;
+	dev->draw_frame = frame;
+	dev->draw_stream = !splash.frame_map && stream.has_ready;
+	if (dev->draw_stream && !stream.ready_shown)
+	{
+		stream.ready_shown = true;
+		stream.shown++;
+	}
+}
+
+static void modeset_render_frame(struct modeset_device *dev)
+{
+	struct modeset_buf *buf = &dev->bufs[dev->front_buf ^ 1];
+	struct slide *slide = dev->draw_slide;
+	unsigned int countdown = dev->draw_countdown, width, height;
+	struct background_geom bg;
+	struct drm_mode_rect cover, *covered = NULL;
+	char time_left[12];
+	cairo_t *cr;
+	cairo_matrix_t m;
+	struct orient o;
+	double lw, lh;
+	size_t written;
+	uint64_t start;
+
+	cairo_text_extents_t te;
+
+	/* a pushed or streamed frame is blitted over the base, which skips the tiles it hides */
+	if (splash.frame_map)
+	{
+		cover = modeset_frame_rect(buf, dev->sw_rotation, splash.frame.width, splash.frame.height);
+		covered = &cover;
+	}
+	else if (dev->draw_stream)
+	{
+		cover = modeset_frame_rect(buf, dev->sw_rotation, stream.width, stream.height);
+		covered = &cover;
+	}
+
+	/* a slide covers the whole buffer, anything else starts from the background */
+	if (background.kind != BACKGROUND_NONE)
+		background_setup(&bg, buf, dev->sw_rotation, dev->bg_from, dev->bg_to);
+	start = get_time_ns();
+	written = modeset_draw_base(buf, slide, dev->draw_frame, background.kind != BACKGROUND_NONE ? &bg : NULL,
+								covered);
+	if (slide)
+	{
+		dev->unpack_ns += get_time_ns() - start;
+		dev->unpack_bytes += written;
+	}
+	dev->base_written += written;
+	dev->base_full += (size_t)buf->stride * buf->height;
+	if (slide && (int)slide->index != dev->last_slide)
+	{
+		dev->slide_switches++;
+		dev->switch_written += written;
+		dev->switch_full += (size_t)buf->stride * buf->height;
+	}
+	dev->last_slide = slide ? (int)slide->index : -1;
+
+	if (splash.frame_map)
+	{
+		modeset_blit_xrgb(buf, splash.frame_map + splash.frame.offset,
+						  splash.frame.width, splash.frame.height, splash.frame.stride, dev->sw_rotation);
+		modeset_mark_tiles(buf, cover.x1, cover.y1, cover.x2, cover.y2);
+	}
+	else if (dev->draw_stream)
+	{
+		modeset_draw_stream(buf, dev->sw_rotation);
+		modeset_mark_tiles(buf, cover.x1, cover.y1, cover.x2, cover.y2);
+	}
+
+	cr = buf->cr;
+	cairo_surface_mark_dirty(buf->surface);
+	cairo_save(cr);
+	/* overlays are drawn upright, rotated here when the plane cannot */
+	o = orient_get(dev->sw_rotation);
+	lw = o.transpose ? buf->height : buf->width;
+	lh = o.transpose ? buf->width : buf->height;
+	if (o.transpose)
+		cairo_matrix_init(&m, 0, o.flip_y ? -1 : 1, o.flip_x ? -1 : 1, 0, o.flip_x ? lh : 0, o.flip_y ? lw : 0);
+	else
+		cairo_matrix_init(&m, o.flip_x ? -1 : 1, 0, 0, o.flip_y ? -1 : 1, o.flip_x ? lw : 0, o.flip_y ? lh : 0);
+	cairo_transform(cr, &m);
+
+	/* and laid out for the mode, the framebuffer may be smaller */
+	if (orient_get(dev->rotation).transpose)
+	{
+		width = dev->mode.vdisplay;
+		height = dev->mode.hdisplay;
+	}
+	else
+	{
+		width = dev->mode.hdisplay;
+		height = dev->mode.vdisplay;
+	}
+	cairo_scale(cr, lw / width, lh / height);
+	cairo_set_source_rgb(cr, 255.0, 255.0, 255.0);
+	cairo_select_font_face(cr, "Georgia",
+			CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+	cairo_set_font_size(cr, 100);
+
+	if (countdown)
+	{
+		sprintf(time_left, "%u", countdown);
+
+		cairo_text_extents(cr, "Please wait, staring CarIOS...", &te);
+		cairo_move_to(cr, 350, height / 2);
+		cairo_show_text(cr, "Please wait, staring CarIOS...");
+		modeset_mark_user(cr, buf, 350 + te.x_bearing, height / 2 + te.y_bearing, te.width, te.height);
+		cairo_text_extents(cr, time_left, &te);
+		cairo_move_to(cr, width / 2, height / 2 + 150);
+		cairo_show_text(cr, time_left);
+		modeset_mark_user(cr, buf, width / 2 + te.x_bearing, height / 2 + 150 + te.y_bearing, te.width, te.height);
+	}
+
+	if (splash.text[0])
+	{
+		cairo_set_font_size(cr, 48);
+		cairo_text_extents(cr, splash.text, &te);
+		cairo_move_to(cr, (width - te.width) / 2, height - 140);
+		cairo_show_text(cr, splash.text);
+		modeset_mark_user(cr, buf, (width - te.width) / 2 + te.x_bearing, height - 140 + te.y_bearing,
+						  te.width, te.height);
+	}
+
+	if (splash.progress != CTL_PROGRESS_OFF)
+	{
+		modeset_mark_user(cr, buf, width / 4 - 2, height - 102, width / 2 + 4, 34);
+		cairo_set_line_width(cr, 4);
+		cairo_rectangle(cr, width / 4, height - 100, width / 2, 30);
+		cairo_stroke(cr);
+		cairo_rectangle(cr, width / 4, height - 100,
+						width / 2 * splash.progress / 100, 30);
+		cairo_fill(cr);
+	}
+
+	cairo_restore(cr);
+	cairo_surface_flush(buf->surface);
+
+	modeset_collect_damage(dev, buf, &dev->bufs[dev->front_buf]);
+}
+
+static void modeset_sched_present(int fd, struct modeset_device *dev, uint64_t when);
+static void stream_pull(void);
+
+/* time the device's content changes next, 0 if it stays static */
+static uint64_t modeset_next_change(const struct modeset_device *dev)
+{
+	uint64_t next = splash_next_change(dev->present_ns);
+
+	if (dev->anim_next_ns && (!next || dev->anim_next_ns < next))
+		next = dev->anim_next_ns;
+	if (dev->bg_next_ns && (!next || dev->bg_next_ns < next))
+		next = dev->bg_next_ns;
+	if (dev->standin_ns && (!next || dev->standin_ns < next))
+		next = dev->standin_ns;
+	return next;
+}
+
+static void render_device_task(void *arg, unsigned int index)
+{
+	struct modeset_device *dev = arg;
+
+	for (;; dev = dev->next)
+	{
+		if (dev->draw_due && !index--)
+			break;
+	}
+	modeset_render_frame(dev);
+}
+
+/*
+ * Prepare every output with draw_due set, one after another, then render
+ * them with one task each and return once all are done. Slides in use
+ * stay cached until then.
+ */
+static void render_devices(struct modeset_device *devices)
+{
+	struct modeset_device *iter;
+	unsigned int count = 0;
+
+	slide_pinned = slide_clock + 1;
+	for (iter = devices; iter; iter = iter->next)
+	{
+		if (!iter->draw_due)
+			continue;
+		modeset_prepare_frame(iter);
+		count++;
+	}
+	render_run(render_device_task, devices, count);
+	slide_pinned = UINT64_MAX;
+}
+
+/* page flip to the frame just rendered, @start is when drawing it began */
+static void modeset_commit_output(int fd, struct modeset_device *dev, uint64_t start)
+{
+	drmModeAtomicReq *req = dev->req;
+	int ret, flags;
+	size_t damage_size = sizeof(dev->damage[0]) * dev->damage_count;
+	uint64_t next, took;
+
+	drmModeAtomicSetCursor(req, 0);
+	ret = modeset_atomic_prepare_commit(fd, dev, req);
+	if (ret < 0)
+	{
+		fprintf(stderr, "prepare atomic commit failed, %d \n", errno);
+		return;
+	}
+
+	/*
+	 * Only a hint, drivers that ignore it update the whole plane. A stream
+	 * or an animation damages the same rectangles frame after frame, those
+	 * keep their blob instead of creating one per flip.
+	 */
+	if (dev->damage_count && drm_object_has_property(&dev->plane, "FB_DAMAGE_CLIPS"))
+	{
+		if (dev->damage_blob && (dev->damage_blob_count != dev->damage_count ||
+								 memcmp(dev->damage_blob_rects, dev->damage, damage_size)))
+		{
+			drmModeDestroyPropertyBlob(fd, dev->damage_blob);
+			dev->damage_blob = 0;
+		}
+		if (!dev->damage_blob && drmModeCreatePropertyBlob(fd, dev->damage, damage_size, &dev->damage_blob) == 0)
+		{
+			memcpy(dev->damage_blob_rects, dev->damage, damage_size);
+			dev->damage_blob_count = dev->damage_count;
+		}
+		if (dev->damage_blob)
+			set_drm_object_property(req, &dev->plane, "FB_DAMAGE_CLIPS", dev->damage_blob);
+	}
+
+	flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	ret = drmModeAtomicCommit(fd, req, flags, NULL);
+	took = get_time_ns() - start;
+	if (took > dev->max_commit_ns)
+		dev->max_commit_ns = took;
+
+	if (ret < 0)
+	{
+		fprintf(stderr, "atomic commit failed ,%d\n", errno);
+		return;
+	}
+
+	dev->front_buf ^= 1;
+	dev->pflip_pending = true;
+
+	/* the next change is armed as soon as this flip completes */
+	next = modeset_next_change(dev);
+	if (next)
+		modeset_sched_present(fd, dev, next);
+}
+
+static struct modeset_card *modeset_find_card(int fd)
+{
+	struct modeset_card *iter;
+
+	for (iter = card_list; iter; iter = iter->next)
+	{
+		if (iter->fd == fd)
+			return iter;
+	}
+
+	return NULL;
+}
+
+/* CRTC ids are only unique within a card */
+static struct modeset_device *modeset_find_device(int fd, unsigned int crtc_id)
+{
+	struct modeset_card *card = modeset_find_card(fd);
+	struct modeset_device *iter;
+
+	for (iter = card ? card->devices : NULL; iter; iter = iter->next)
+	{
+		if (iter->crtc.id == crtc_id)
+			return iter;
+	}
+
+	return NULL;
+}
+
+/*
+ * Turn dev->target_ns into a vblank number and ask the kernel to wake us up
+ * one vblank before it, which leaves a full refresh period to render and
+ * commit. When that wake-up point has already passed the frame is drawn
+ * right away, by the next modeset_flush(), and lands on the next vblank.
+ */
+static void modeset_sched_arm(int fd, struct modeset_device *dev)
+{
+	uint64_t seq, ns, queued, target_seq, vblanks;
+	int ret;
+
+	ret = drmCrtcGetSequence(fd, dev->crtc.id, &seq, &ns);
+	if (ret)
+	{
+		fprintf(stderr, "cannot get sequence of crtc %u, drawing now (%d):%m\n", dev->crtc.id, errno);
+		dev->target_pending = false;
+		dev->present_ns = dev->target_ns;
+		dev->draw_due = true;
+		return;
+	}
+
+	/*
+	 * The first vblank at or after the target time, at the earliest the
+	 * next one. Content is picked for present_ns, a vblank before the
+	 * target would still show what it replaces.
+	 */
+	vblanks = 1;
+	if (dev->target_ns > ns)
+		vblanks = (dev->target_ns - ns + dev->frame_ns - 1) / dev->frame_ns;
+	if (vblanks < 1)
+		vblanks = 1;
+	target_seq = seq + vblanks;
+
+	if (target_seq - 1 <= seq)
+	{
+		dev->target_pending = false;
+		dev->present_ns = ns + dev->frame_ns;
+		dev->draw_due = true;
+		return;
+	}
+
+	ret = drmCrtcQueueSequence(fd, dev->crtc.id, DRM_CRTC_SEQUENCE_NEXT_ON_MISS,
+							   target_seq - 1, &queued, dev->crtc.id);
+	if (ret)
+	{
+		fprintf(stderr, "cannot queue sequence %llu on crtc %u (%d):%m\n",
+				(unsigned long long)(target_seq - 1), dev->crtc.id, errno);
+		dev->target_pending = false;
+		dev->present_ns = ns + dev->frame_ns;
+		dev->draw_due = true;
+		return;
+	}
+
+	dev->seq_queued = true;
+}
+
+/*
+ * Request a frame to be shown at @when (CLOCK_MONOTONIC). Only one target is
+ * kept per device; a later request replaces an earlier one that has not been
+ * armed yet. While a flip is in flight the request is armed from the flip
+ * handler.
+ */
+static void modeset_sched_present(int fd, struct modeset_device *dev, uint64_t when)
+{
+	dev->target_ns = when;
+	dev->target_pending = true;
+
+	if (dev->pflip_pending || dev->seq_queued || dev->cleanup)
+		return;
+
+	modeset_sched_arm(fd, dev);
+}
+
+static void modeset_sequence_event(int fd, uint64_t sequence, uint64_t ns, uint64_t data)
+{
+	struct modeset_device *dev;
+
+	dev = modeset_find_device(fd, data);
+	if (dev == NULL)
+		return;
+
+	dev->seq_queued = false;
+	if (dev->cleanup || !dev->target_pending)
+		return;
+
+	/* woken one vblank early, the frame is scanned out at the next one */
+	dev->target_pending = false;
+	dev->present_ns = ns + dev->frame_ns;
+	/* and an estimate that lands a hair short still shows the new content */
+	if (dev->present_ns < dev->target_ns)
+		dev->present_ns = dev->target_ns;
+	dev->draw_due = true;
+}
+
+static void modeset_page_flip_event(int fd, unsigned int frame, unsigned int sec, unsigned int usec, unsigned int crtc_id, void *data)
+{
+	struct modeset_device *dev;
+	int64_t error;
+
+	dev = modeset_find_device(fd, crtc_id);
+	if (dev == NULL)
+		return;
+
+	dev->pflip_pending = false;
+	dev->flip_ns = (uint64_t)sec * NSEC_PER_SEC + (uint64_t)usec * 1000;
+	dev->frames_presented++;
+
+	/* the first flip is the modeset, its timing is not ours to judge */
+	error = (int64_t)(dev->flip_ns - dev->present_ns);
+	if (error < 0)
+		error = -error;
+	if (dev->frames_presented > 1 && error > dev->max_present_error_ns)
+		dev->max_present_error_ns = error;
+
+	/* flips are timestamped at the vblank the frame starts scanning out at */
+	if (dev->frames_presented == 1)
+		fprintf(stderr, "crtc %u: first frame on screen %.1f ms after process start\n",
+				dev->crtc.id, (dev->flip_ns - process_start_ns) / 1e6);
+	if (dev->first_slide_pending)
+	{
+		dev->first_slide_pending = false;
+		dev->first_slide_ns = dev->flip_ns;
+		fprintf(stderr, "crtc %u: first slide on screen %.1f ms after process start, from the %s\n",
+				dev->crtc.id, (dev->flip_ns - process_start_ns) / 1e6,
+				dev->first_slide_standin ? "built-in splash" : "file");
+	}
+
+	/* frames skipped over, and vblanks the previous frame stayed up past this one's due time */
+	if (dev->anim_pending)
+	{
+		dev->anim_pending = false;
+		dev->anim_presented++;
+		if (dev->anim_shown >= 0 && dev->anim_pending_n > (uint64_t)dev->anim_shown + 1)
+			dev->anim_dropped += dev->anim_pending_n - dev->anim_shown - 1;
+		if (dev->anim_shown >= 0 && dev->flip_ns > dev->anim_pending_due)
+			dev->anim_duplicated += (dev->flip_ns - dev->anim_pending_due + dev->frame_ns / 2) / dev->frame_ns;
+		dev->anim_shown = dev->anim_pending_n;
+	}
+
+	if (dev->cleanup)
+		return;
+
+	stream_pull();
+	if (dev->target_pending && !dev->seq_queued && !dev->pflip_pending)
+		modeset_sched_arm(fd, dev);
+}
+
+/* all outputs of a card come up in one atomic commit */
+static int modeset_perform_modeset(struct modeset_card *card)
+{
+	int ret = 0, flags, fd = card->fd;
+	struct modeset_device *iter;
+	drmModeAtomicReq *req;
+	uint64_t now, next;
+
+	req = drmModeAtomicAlloc();
+	for (iter = card->devices; iter; iter = iter->next)
+	{
+		ret = modeset_atomic_prepare_commit(fd, iter, req);
+		if (ret < 0)
+			break;
+	}
+
+	if (ret < 0)
+	{
+		fprintf(stderr, "prepare atomic commit failed,%d\n", errno);
+		drmModeAtomicFree(req);
+		return ret;
+	}
+
+	flags = DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET;
+	ret = drmModeAtomicCommit(fd, req, flags, NULL);
+	if (ret < 0)
+	{
+		fprintf(stderr, "test-only atomic commit failed,%d\n", errno);
+		drmModeAtomicFree(req);
+		return ret;
+	}
+
+	now = get_time_ns();
+	for (iter = card->devices; iter; iter = iter->next)
+	{
+		/* a full modeset takes a few frames, so present_ns is only a guess */
+		iter->present_ns = now;
+		iter->draw_due = true;
+	}
+	render_devices(card->devices);
+	for (iter = card->devices; iter; iter = iter->next)
+		iter->draw_due = false;
+
+	flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_ALLOW_MODESET;
+	ret = drmModeAtomicCommit(fd, req, flags, NULL);
+	drmModeAtomicFree(req);
+	if (ret < 0)
+	{
+		fprintf(stderr, "atomic modeset commit failed,%d\n", errno);
+		return ret;
+	}
+
+	for (iter = card->devices; iter; iter = iter->next)
+	{
+		iter->pflip_pending = true;
+		next = modeset_next_change(iter);
+		if (next)
+			modeset_sched_present(fd, iter, next);
+	}
+
+	return ret;
+}
+
+/*
+ * Draw every output of @card that is due, all at once on the render pool,
+ * then commit each. Outputs that wake for the same vblank render in
+ * parallel instead of one after another.
+ */
+static void modeset_flush(struct modeset_card *card)
+{
+	struct modeset_device *iter;
+	uint64_t start = get_time_ns();
+
+	render_devices(card->devices);
+	for (iter = card->devices; iter; iter = iter->next)
+	{
+		if (!iter->draw_due)
+			continue;
+		iter->draw_due = false;
+		modeset_commit_output(card->fd, iter, start);
+	}
+}
+
+static int modeset_handle_events(int fd)
+{
+	drmEventContext ev;
+	int ret;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.version = 4;
+	ev.page_flip_handler2 = modeset_page_flip_event;
+	ev.sequence_handler = modeset_sequence_event;
+
+	ret = drmHandleEvent(fd, &ev);
+	modeset_flush(modeset_find_card(fd));
+	return ret;
+}
+
+static void modeset_draw(void)
+{
+	struct modeset_card *card;
+
+	splash_start_ns = get_time_ns();
+	for (card = card_list; card; card = card->next)
+		modeset_perform_modeset(card);
+}
+
+/* ask every output of every card for a frame at @when */
+static void modeset_sched_all(uint64_t when)
+{
+	struct modeset_card *card;
+	struct modeset_device *iter;
+
+	for (card = card_list; card; card = card->next)
+	{
+		for (iter = card->devices; iter; iter = iter->next)
+			modeset_sched_present(card->fd, iter, when);
+		modeset_flush(card);
+	}
+}
+
+static void modeset_cleanup(struct modeset_card *card)
+{
+	struct modeset_device *iter;
+	int ret, fd = card->fd;
+
+	while (card->devices)
+	{
+		iter = card->devices;
+
+		iter->cleanup = true;
+		fprintf(stderr, "wait for pending page-flip to complete...\n");
+		while (iter->pflip_pending)
+		{
+			ret = modeset_handle_events(fd);
+			if (ret)
+				break;
+		}
+
+		fprintf(stderr, "crtc %u: %u frames presented, max presentation error %lld us, max commit latency %llu us\n",
+				iter->crtc.id, iter->frames_presented, (long long)iter->max_present_error_ns / 1000,
+				(unsigned long long)iter->max_commit_ns / 1000);
+		fprintf(stderr, "crtc %u: background fills wrote %llu of %llu bytes, slides unpacked at %.2f GB/s\n",
+				iter->crtc.id, (unsigned long long)iter->base_written, (unsigned long long)iter->base_full,
+				iter->unpack_ns ? (double)iter->unpack_bytes / iter->unpack_ns : 0.0);
+		if (iter->slide_switches)
+			fprintf(stderr, "crtc %u: %u slide switches wrote %llu of %llu bytes\n",
+					iter->crtc.id, iter->slide_switches, (unsigned long long)iter->switch_written,
+					(unsigned long long)iter->switch_full);
+		if (iter->anim_presented)
+			fprintf(stderr, "crtc %u: animation frames presented %u, dropped %u, duplicated %u\n",
+					iter->crtc.id, iter->anim_presented, iter->anim_dropped, iter->anim_duplicated);
+
+		card->devices = iter->next;
+
+		modeset_device_destory(fd, iter);
+	}
+}
+
+static void modeset_cleanup_cards(void)
+{
+	struct modeset_card *card;
+
+	while (card_list)
+	{
+		/* events still find the card while its flips complete */
+		card = card_list;
+		modeset_cleanup(card);
+		card_list = card->next;
+		close(card->fd);
+		free(card);
+	}
+}
+
+/*
+ * Hand the outputs of @card to the next DRM master: no new frames, the
+ * flips in flight complete, then only the framebuffers being scanned out
+ * are kept and master is dropped. The successor can commit over them
+ * without a modeset of its own, the screen never goes dark in between.
+ */
+static int modeset_handoff(struct modeset_card *card)
+{
+	struct modeset_device *iter;
+	uint64_t now;
+	int ret;
+
+	for (iter = card->devices; iter; iter = iter->next)
+	{
+		iter->cleanup = true;
+		iter->draw_due = false;
+	}
+	for (iter = card->devices; iter; iter = iter->next)
+	{
+		while (iter->pflip_pending)
+		{
+			if (modeset_handle_events(card->fd))
+				break;
+		}
+	}
+
+	for (iter = card->devices; iter; iter = iter->next)
+	{
+		modeset_destroy_fb(card->fd, &iter->bufs[iter->front_buf ^ 1]);
+		modeset_release_fb(card->fd, &iter->bufs[iter->front_buf]);
+		iter->handoff_fb = iter->bufs[iter->front_buf].fb;
+		iter->handoff_kept = modeset_close_fb(card->fd, &iter->bufs[iter->front_buf]);
+	}
+
+	ret = drmDropMaster(card->fd);
+	now = get_time_ns();
+	if (ret)
+	{
+		fprintf(stderr, "%s: cannot drop master (%d):%m\n", card->node, errno);
+		return ret;
+	}
+
+	fprintf(stderr, "%s: master dropped %.2f ms after the handoff request\n", card->node,
+			(now - handoff_ready_ns) / 1e6);
+	for (iter = card->devices; iter; iter = iter->next)
+		iter->handoff_ns = now;
+	return 0;
+}
+
+#if 0
+static int g_terminate = 0;
+void signal_handler(int signo)
+{
+    switch (signo) {
+        case SIGUSR1:
+        case SIGUSR2:
+        case SIGTERM:
+        case SIGKILL:
+            g_terminate = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+/* Install OS signal handler */
+sighandler_t sig_install_handler(int sig, sighandler_t handler)
+{
+    struct sigaction add_sig;
+
+    /* get current signal action */
+    if (sigaction(sig, NULL, &add_sig) < 0) {
+        qCritical() << "sigaction() #1: failed:" << strerror(errno);
+        return SIG_ERR;
+    }
+
+    add_sig.sa_handler = handler;
+
+    /* set signal number to signal set mask */
+    if (sigaddset(&add_sig.sa_mask, sig)) {
         qCritical() << "sigaddset() #2: failed:" << strerror(errno);
         return SIG_ERR;
     }
 
-    /* set our signal action */
-    add_sig.sa_flags = SA_RESTART;
-    if (sigaction(sig, &add_sig, NULL) < 0) {
-        qCritical() << "sigaction() #3: failed:" << strerror(errno);
-        return SIG_ERR;
-    }
+    /* set our signal action */
+    add_sig.sa_flags = SA_RESTART;
+    if (sigaction(sig, &add_sig, NULL) < 0) {
+        qCritical() << "sigaction() #3: failed:" << strerror(errno);
+        return SIG_ERR;
+    }
+
+    return add_sig.sa_handler;
+}
+
+static inline void catchsignals()
+{
+    if (sig_install_handler(SIGUSR1, signal_handler) == SIG_ERR) {
+        return -EINVAL;
+    }
+    if (sig_install_handler(SIGUSR2, signal_handler) == SIG_ERR) {
+        return -EINVAL;
+    }
+    if (sig_install_handler(SIGTERM, signal_handler) == SIG_ERR) {
+        return -EINVAL;
+    }
+}
+#endif
+
+static int fd_epoll;
+static int register_signals(sigset_t* prevSigset, sigset_t* newSigset)
+{
+    struct epoll_event event;
+    sigset_t mask;
+    int sfd;
+
+    sigemptyset(newSigset);
+    sigemptyset(prevSigset);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGKILL);
+    sigaddset(&mask, SIGTERM);
+
+    if (sigprocmask(SIG_SETMASK, &mask, prevSigset) == -1) {
+        fprintf(stderr, "Failed to setup signal proc mask!\n");
+        return -EINVAL;
+    }
+
+    sfd = signalfd(-1, &mask, SFD_NONBLOCK);
+    if (sfd == -1) {
+        fprintf(stderr, "Failed to get signal fd!\n");
+        return -EINVAL;
+    }
+
+    /* Add fd to be monitored by epoll */
+    event.events = EPOLLIN;
+    event.data.fd = sfd;
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, sfd, &event) == -1) {
+        fprintf(stderr, "Failed to register signal: %d\n", sfd);
+        close(sfd);
+        return -EINVAL;
+    }
+
+    (*newSigset) = mask;
+    return sfd;
+}
+
+static int fd_signals;
+static sigset_t g_sigset_prev;
+static sigset_t g_sigset_new;
+
+static inline int catch_signals()
+{    
+	/* allocate epoll file descriptor */
+    fd_epoll = epoll_create(6);
+    if (fd_epoll < 0) {
+        return -EINVAL;
+    }
+
+    /* monitor process signals, so we can terminate thread
+     * loop with registred SIGxxx signals. This terminates
+     * the CarIOS main process with SIGINT too. */
+    if ((fd_signals = register_signals(&g_sigset_prev, &g_sigset_new)) < 0) {
+        fprintf(stderr, "Failed to register signals. err=%d\n", errno);
+        close(fd_epoll);
+        fd_epoll = -1;
+        return -EINVAL;
+    }
+
+	return 0;
+}
+
+/* check epoll event error flags  */
+static int check_event_flags(unsigned long flags)
+{
+    bool result = 0;
+    if (!(flags & EPOLLIN) && ((flags & EPOLLERR) || (flags & EPOLLHUP))) {
+        if (flags & EPOLLERR) {
+            fprintf(stderr, "EPOLLERR detected.\n");
+            result = -EINVAL;
+        }
+        if (flags & EPOLLHUP) {
+            fprintf(stderr, "EPOLLHUP detected.\n");
+            result = -EINVAL;
+        }
+    }
+    return result;
+}
+
+static int should_terminate(const int fd)
+{
+    struct signalfd_siginfo sfd_si;
+    int ret;
+
+    /* read signals */
+    while ((ret = read(fd, &sfd_si, sizeof(sfd_si)))) {
+
+        if (ret <= 0)
+            break;
+
+        switch (sfd_si.ssi_signo) {
+			case SIGHUP:
+			case SIGUSR1:
+			case SIGUSR2:
+            case SIGTERM:
+            case SIGKILL:
+            case SIGINT: {
+                fprintf(stderr, "Terminate signal: %d\n", sfd_si.ssi_signo);
+				return sfd_si.ssi_signo;
+            }
+            default: {
+                fprintf(stderr, "Unhandled signal: %d\n", sfd_si.ssi_signo);
+            }
+        }
+    }
+    return 0;
+}
+
+static int fd_control = -1;
+
+static int control_open(void)
+{
+	struct sockaddr_un addr;
+	struct epoll_event event;
+	int sfd;
+
+	sfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sfd < 0)
+	{
+		fprintf(stderr, "cannot create control socket (%d):%m\n", errno);
+		return -errno;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, CONTROL_SOCKET, sizeof(addr.sun_path) - 1);
+	unlink(CONTROL_SOCKET);
+
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "cannot bind control socket '%s' (%d):%m\n", CONTROL_SOCKET, errno);
+		close(sfd);
+		return -errno;
+	}
+
+	event.events = EPOLLIN;
+	event.data.fd = sfd;
+	if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, sfd, &event) == -1)
+	{
+		fprintf(stderr, "Failed to register control socket: %d\n", sfd);
+		close(sfd);
+		unlink(CONTROL_SOCKET);
+		return -EINVAL;
+	}
+
+	fd_control = sfd;
+	return 0;
+}
+
+static void control_drop_frame(void)
+{
+	if (splash.frame_map)
+		munmap(splash.frame_map, splash.frame_size);
+	splash.frame_map = NULL;
+	splash.frame_size = 0;
+}
+
+static void control_close(void)
+{
+	if (fd_control < 0)
+		return;
+
+	close(fd_control);
+	unlink(CONTROL_SOCKET);
+	fd_control = -1;
+	control_drop_frame();
+}
+
+/*
+ * Map the memfd a client pushed a frame in. The pixels are read straight
+ * from the mapping when the next back buffer is drawn, so the fd must be
+ * sealed against shrinking or a misbehaving client could SIGBUS us.
+ */
+static int control_set_frame(const struct ctl_frame *frame, int mfd)
+{
+	struct stat st;
+	uint64_t size;
+	uint8_t *map;
+	int seals;
+
+	if (frame->format != DRM_FORMAT_XRGB8888 || !frame->width || !frame->height ||
+		frame->width > CTL_FRAME_DIM_MAX || frame->height > CTL_FRAME_DIM_MAX ||
+		(uint64_t)frame->width * 4 > frame->stride || frame->stride % 4 || frame->offset % 4)
+	{
+		fprintf(stderr, "control: unsupported frame %ux%u stride %u format %08x\n",
+				frame->width, frame->height, frame->stride, frame->format);
+		return -EINVAL;
+	}
+
+	seals = fcntl(mfd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK))
+	{
+		fprintf(stderr, "control: frame fd is not sealed against shrinking\n");
+		return -EPERM;
+	}
+
+	if (fstat(mfd, &st) < 0)
+		return -errno;
+
+	size = (uint64_t)frame->stride * frame->height;
+	if (frame->offset > (uint64_t)st.st_size || size > (uint64_t)st.st_size - frame->offset)
+	{
+		fprintf(stderr, "control: frame exceeds its fd (%lld bytes)\n", (long long)st.st_size);
+		return -EINVAL;
+	}
+
+	size += frame->offset;
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, mfd, 0);
+	if (map == MAP_FAILED)
+	{
+		fprintf(stderr, "control: cannot map frame (%d):%m\n", errno);
+		return -errno;
+	}
+
+	control_drop_frame();
+	splash.frame_map = map;
+	splash.frame_size = size;
+	splash.frame = *frame;
+	return 0;
+}
+
+/* returns true if the command changed what is on screen */
+static bool control_handle(const struct ctl_header *hdr, const uint8_t *payload, int mfd, bool *quit)
+{
+	switch (hdr->cmd)
+	{
+	case CTL_SLIDE:
+		control_drop_frame();
+		splash.slide = hdr->arg;
+		break;
+	case CTL_PROGRESS:
+		splash.progress = hdr->arg > 100 && hdr->arg != CTL_PROGRESS_OFF ? 100 : hdr->arg;
+		break;
+	case CTL_TEXT:
+		if (hdr->len > CTL_TEXT_MAX)
+			return false;
+		memcpy(splash.text, payload, hdr->len);
+		splash.text[hdr->len] = '\0';
+		break;
+	case CTL_FRAME:
+		if (hdr->len == 0)
+		{
+			control_drop_frame();
+			break;
+		}
+		if (hdr->len != sizeof(struct ctl_frame) || mfd < 0)
+		{
+			fprintf(stderr, "control: malformed frame command\n");
+			return false;
+		}
+		if (control_set_frame((const struct ctl_frame *)payload, mfd))
+			return false;
+		break;
+	case CTL_QUIT:
+		*quit = true;
+		return false;
+	case CTL_HANDOFF:
+		handoff_ready_ns = get_time_ns();
+		*quit = true;
+		return false;
+	default:
+		fprintf(stderr, "control: unknown command %u\n", hdr->cmd);
+		return false;
+	}
+
+	splash.controlled = true;
+	return true;
+}
+
+/*
+ * Drain every queued command before asking for a redraw, so a burst of
+ * updates is merged into one frame. modeset_sched_present() keeps a single
+ * target per device, which limits this to one frame per vblank.
+ */
+static int control_dispatch(void)
+{
+	uint8_t msg[sizeof(struct ctl_header) + CTL_TEXT_MAX];
+	union
+	{
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct ctl_header hdr;
+	struct cmsghdr *ch;
+	struct msghdr mh;
+	struct iovec iov;
+	bool changed = false, quit = false;
+	ssize_t len;
+	size_t i;
+	int mfd, fd;
+
+	for (;;)
+	{
+		iov.iov_base = msg;
+		iov.iov_len = sizeof(msg);
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cmsg.buf;
+		mh.msg_controllen = sizeof(cmsg.buf);
+
+		len = recvmsg(fd_control, &mh, MSG_CMSG_CLOEXEC);
+		if (len < 0)
+		{
+			if (errno != EAGAIN && errno != EINTR)
+				fprintf(stderr, "control: recvmsg failed (%d):%m\n", errno);
+			break;
+		}
+
+		/* the first fd is the frame, anything else passed along is closed */
+		mfd = -1;
+		for (ch = CMSG_FIRSTHDR(&mh); ch; ch = CMSG_NXTHDR(&mh, ch))
+		{
+			if (ch->cmsg_level != SOL_SOCKET || ch->cmsg_type != SCM_RIGHTS)
+				continue;
+			for (i = 0; i < (ch->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++)
+			{
+				memcpy(&fd, CMSG_DATA(ch) + i * sizeof(int), sizeof(fd));
+				if (mfd < 0)
+					mfd = fd;
+				else
+					close(fd);
+			}
+		}
+
+		memcpy(&hdr, msg, sizeof(hdr));
+		if (len < (ssize_t)sizeof(hdr) || (mh.msg_flags & MSG_TRUNC) ||
+			hdr.len != len - sizeof(hdr))
+			fprintf(stderr, "control: dropping malformed message (%zd bytes)\n", len);
+		else if (control_handle(&hdr, msg + sizeof(hdr), mfd, &quit))
+			changed = true;
+
+		/* the frame mapping keeps its own reference */
+		if (mfd >= 0)
+			close(mfd);
+	}
+
+	if (changed)
+		modeset_sched_all(get_time_ns());
+
+	return quit;
+}
+
+/* bootsplash -c slide N | progress N|off | text STRING | handoff | quit */
+static int control_send(int argc, char **argv)
+{
+	uint8_t msg[sizeof(struct ctl_header) + CTL_TEXT_MAX];
+	struct ctl_header hdr;
+	struct sockaddr_un addr;
+	size_t len;
+	int sfd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (!strcmp(argv[0], "slide") && argc > 1)
+	{
+		hdr.cmd = CTL_SLIDE;
+		hdr.arg = strtoul(argv[1], NULL, 0);
+	}
+	else if (!strcmp(argv[0], "progress") && argc > 1)
+	{
+		hdr.cmd = CTL_PROGRESS;
+		hdr.arg = strcmp(argv[1], "off") ? strtoul(argv[1], NULL, 0) : CTL_PROGRESS_OFF;
+	}
+	else if (!strcmp(argv[0], "text") && argc > 1)
+	{
+		hdr.cmd = CTL_TEXT;
+		len = strlen(argv[1]);
+		hdr.len = len > CTL_TEXT_MAX ? CTL_TEXT_MAX : len;
+	}
+	else if (!strcmp(argv[0], "handoff"))
+	{
+		hdr.cmd = CTL_HANDOFF;
+	}
+	else if (!strcmp(argv[0], "quit"))
+	{
+		hdr.cmd = CTL_QUIT;
+	}
+	else
+	{
+		fprintf(stderr, "usage: bootsplash -c slide N | progress N|off | text STRING | handoff | quit\n");
+		return EXIT_FAILURE;
+	}
+
+	memcpy(msg, &hdr, sizeof(hdr));
+	if (hdr.cmd == CTL_TEXT)
+		memcpy(msg + sizeof(hdr), argv[1], hdr.len);
+
+	sfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sfd < 0)
+	{
+		fprintf(stderr, "cannot create socket (%d):%m\n", errno);
+		return EXIT_FAILURE;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, CONTROL_SOCKET, sizeof(addr.sun_path) - 1);
+
+	if (sendto(sfd, msg, sizeof(hdr) + hdr.len, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "cannot send to '%s' (%d):%m\n", CONTROL_SOCKET, errno);
+		close(sfd);
+		return EXIT_FAILURE;
+	}
+
+	close(sfd);
+	return EXIT_SUCCESS;
+}
+
+static int stream_open(const char *path)
+{
+	struct epoll_event event;
+
+	if (stream.format == DRM_FORMAT_NV12 && ((stream.width | stream.height) & 1))
+	{
+		fprintf(stderr, "NV12 frames need an even size, got %ux%u\n", stream.width, stream.height);
+		return -EINVAL;
+	}
+
+	if (stream.format == DRM_FORMAT_NV12)
+		stream.frame_size = (size_t)stream.width * stream.height * 3 / 2;
+	else
+		stream.frame_size = (size_t)stream.width * stream.height * 4;
+
+	stream.fill = malloc(stream.frame_size);
+	stream.ready = malloc(stream.frame_size);
+	if (!stream.fill || !stream.ready)
+		goto err_free;
+
+	if (!strcmp(path, "-"))
+		stream.fd = dup(STDIN_FILENO);
+	else
+		stream.fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (stream.fd < 0)
+	{
+		fprintf(stderr, "cannot open stream '%s' (%d):%m\n", path, errno);
+		goto err_free;
+	}
+	fcntl(stream.fd, F_SETFL, fcntl(stream.fd, F_GETFL) | O_NONBLOCK);
+
+	/* regular files cannot be polled, they are read one frame per flip */
+	event.events = EPOLLIN;
+	event.data.fd = stream.fd;
+	stream.pollable = epoll_ctl(fd_epoll, EPOLL_CTL_ADD, stream.fd, &event) == 0;
+	if (!stream.pollable && errno != EPERM)
+	{
+		fprintf(stderr, "Failed to register stream fd: %d\n", stream.fd);
+		close(stream.fd);
+		stream.fd = -1;
+		goto err_free;
+	}
+
+	fprintf(stderr, "streaming %ux%u %s frames from '%s'\n", stream.width, stream.height,
+			stream.format == DRM_FORMAT_NV12 ? "NV12" : "XRGB8888", path);
+	return 0;
+
+err_free:
+	free(stream.fill);
+	free(stream.ready);
+	stream.fill = stream.ready = NULL;
+	return -EINVAL;
+}
+
+static void stream_close(void)
+{
+	if (stream.fd >= 0)
+	{
+		if (stream.pollable)
+			epoll_ctl(fd_epoll, EPOLL_CTL_DEL, stream.fd, NULL);
+		close(stream.fd);
+		stream.fd = -1;
+	}
+}
+
+static void stream_free(void)
+{
+	stream_close();
+	if (stream.received)
+		fprintf(stderr, "stream: %llu frames received, %llu shown, %llu dropped\n",
+				(unsigned long long)stream.received, (unsigned long long)stream.shown,
+				(unsigned long long)stream.dropped);
+	free(stream.fill);
+	free(stream.ready);
+	stream.fill = stream.ready = NULL;
+}
+
+#define HANDOFF_TIMEOUT_MS 10000
+
+/*
+ * Watch the handed over CRTCs until the next master shows a framebuffer
+ * of its own, which tells how long the handoff took and whether, and for
+ * how long, the screen was dark in between. Polled every millisecond,
+ * a signal or HANDOFF_TIMEOUT_MS end the wait.
+ */
+static void modeset_handoff_wait(void)
+{
+	struct epoll_event event;
+	struct modeset_card *card;
+	struct modeset_device *iter;
+	unsigned int waiting;
+	drmModeCrtc *crtc;
+	uint64_t now;
+	bool timeout;
+
+	/* a successor starting up must not wait behind the polls */
+	if (rt_priority)
+		sched_setscheduler(0, SCHED_OTHER, &(struct sched_param){ 0 });
+
+	for (;;)
+	{
+		waiting = 0;
+		now = get_time_ns();
+		timeout = now - handoff_ready_ns > HANDOFF_TIMEOUT_MS * NSEC_PER_MSEC;
+		for (card = card_list; card; card = card->next)
+		{
+			for (iter = card->devices; iter; iter = iter->next)
+			{
+				if (!iter->handoff_ns || iter->handoff_taken_ns)
+					continue;
+
+				crtc = drmModeGetCrtc(card->fd, iter->crtc.id);
+				if (crtc && crtc->mode_valid && crtc->buffer_id && crtc->buffer_id != iter->handoff_fb)
+					iter->handoff_taken_ns = now;
+				else if ((!crtc || !crtc->mode_valid || !crtc->buffer_id) && !iter->handoff_black_ns)
+					iter->handoff_black_ns = now;
+				drmModeFreeCrtc(crtc);
+
+				if (iter->handoff_taken_ns)
+					fprintf(stderr, "crtc %u: next master took over %.1f ms after the handoff request, dark for %.1f ms\n",
+							iter->crtc.id, (iter->handoff_taken_ns - handoff_ready_ns) / 1e6,
+							iter->handoff_black_ns ? (iter->handoff_taken_ns - iter->handoff_black_ns) / 1e6 : 0.0);
+				else if (timeout)
+					fprintf(stderr, "crtc %u: no new master after %u ms%s\n", iter->crtc.id, HANDOFF_TIMEOUT_MS,
+							iter->handoff_black_ns ? ", the screen is dark" :
+							iter->handoff_kept ? ", leaving the last frame up" : ", the screen goes dark on exit");
+				else
+					waiting++;
+			}
+		}
+		if (!waiting)
+			return;
+
+		if (epoll_pwait(fd_epoll, &event, 1, 1, &g_sigset_new) != 1)
+			continue;
+		if (event.data.fd == fd_signals && should_terminate(fd_signals))
+			return;
+		if (modeset_find_card(event.data.fd))
+			modeset_handle_events(event.data.fd);
+	}
+}
+
+/* stop drawing on every card and wait for the next master, see modeset_handoff() */
+static void modeset_handoff_cards(void)
+{
+	struct modeset_card *card;
+
+	/* nothing else may wake the wait */
+	stream_close();
+	for (card = card_list; card; card = card->next)
+		modeset_handoff(card);
+	modeset_handoff_wait();
+}
+
+/*
+ * Read whatever the source has, keeping only the newest complete frame.
+ * With @one set reading stops after a single frame, which paces regular
+ * files at the display rate. The last frame stays on screen at EOF.
+ */
+static void stream_read(bool one)
+{
+	bool completed = false;
+	uint8_t *tmp;
+	ssize_t ret;
+
+	while (stream.fd >= 0)
+	{
+		ret = read(stream.fd, stream.fill + stream.filled, stream.frame_size - stream.filled);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			break;
+		if (ret <= 0)
+		{
+			if (ret < 0)
+				fprintf(stderr, "stream read failed (%d):%m\n", errno);
+			else
+				fprintf(stderr, "end of stream\n");
+			stream_close();
+			break;
+		}
+
+		stream.filled += ret;
+		if (stream.filled < stream.frame_size)
+			continue;
+
+		/* latest frame wins, an unshown ready frame is dropped */
+		if (stream.has_ready && !stream.ready_shown)
+			stream.dropped++;
+
+		tmp = stream.ready;
+		stream.ready = stream.fill;
+		stream.fill = tmp;
+		stream.filled = 0;
+		stream.has_ready = true;
+		stream.ready_shown = false;
+		stream.received++;
+		completed = true;
+
+		if (one)
+			break;
+	}
+
+	if (!completed)
+		return;
+
+	splash.controlled = true;
+	modeset_sched_all(get_time_ns());
+}
+
+/* called after each flip, feeds non-pollable sources once the frame was shown */
+static void stream_pull(void)
+{
+	if (stream.fd < 0 || stream.pollable)
+		return;
+	if (stream.has_ready && !stream.ready_shown)
+		return;
+
+	stream_read(true);
+}
+
+/* bootsplash -G WxH [fps]: moving test pattern on stdout, XRGB8888 */
+static int stream_generate(uint32_t width, uint32_t height, unsigned int fps)
+{
+	struct timespec next;
+	uint32_t *frame, j, k, n;
+	size_t size, done;
+	ssize_t ret;
+
+	size = (size_t)width * height * 4;
+	frame = malloc(size);
+	if (!frame)
+		return EXIT_FAILURE;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (n = 0;; n++)
+	{
+		for (j = 0; j < height; ++j)
+			for (k = 0; k < width; ++k)
+				frame[j * width + k] = ((k + n * 4) % width < width / 8) ? 0xffffff :
+									   ((k * 255 / width) << 16) | ((j * 255 / height) << 8) | (n & 0xff);
+
+		for (done = 0; done < size; done += ret)
+		{
+			ret = write(STDOUT_FILENO, (uint8_t *)frame + done, size - done);
+			if (ret < 0 && errno == EINTR)
+				ret = 0;
+			else if (ret < 0)
+			{
+				free(frame);
+				return errno == EPIPE ? EXIT_SUCCESS : EXIT_FAILURE;
+			}
+		}
+
+		next.tv_nsec += NSEC_PER_SEC / fps;
+		while (next.tv_nsec >= (long)NSEC_PER_SEC)
+		{
+			next.tv_nsec -= NSEC_PER_SEC;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+}
+
+/*
+ * atomicmode -E WxH IMAGE [raw]: write a C header to stdout that holds
+ * IMAGE as a struct slide_asset named embedded_splash, fitted to WxH
+ * XRGB8888 and packed with the tile codec, or as plain pixels with 'raw'.
+ * Tile hashes are in host byte order, the header refuses to build for
+ * a target of the other one.
+ */
+static int embed_generate(uint32_t width, uint32_t height, const char *path, bool raw)
+{
+	static const char hex[] = "0123456789abcdef";
+	char line[32 * 4 + 4], *o;
+	struct slide slide;
+	const uint8_t *data;
+	size_t size, i, j, count;
+	int ret;
+
+	memset(&slide, 0, sizeof(slide));
+	slide.width = width;
+	slide.height = height;
+	slide.stride = width * 4;
+	slide.format = DRM_FORMAT_XRGB8888;
+	ret = slide_load(&slide, path);
+	if (ret == 0 && !raw)
+		ret = slide_pack_frame(&slide, NULL, 0);
+	if (ret)
+	{
+		fprintf(stderr, "cannot load '%s': %s\n", path, strerror(-ret));
+		slide_release(&slide);
+		return EXIT_FAILURE;
+	}
+
+	printf("/* generated by 'atomicmode -E %ux%u %s%s', do not edit */\n\n", width, height, path, raw ? " raw" : "");
+	printf("#if __BYTE_ORDER__ != %d\n#error \"embedded splash generated for the other byte order\"\n#endif\n\n",
+		   __BYTE_ORDER__);
+
+	count = (size_t)((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+	if (raw)
+	{
+		data = slide.data;
+		size = (size_t)slide.stride * height;
+	}
+	else
+	{
+		data = slide.packed;
+		size = slide.packed_size;
+
+		printf("static const uint64_t embedded_tiles[%zu] = {\n", count);
+		for (i = 0; i < count; i++)
+			printf("%s0x%016llxull,%s", i % 4 ? " " : "\t", (unsigned long long)slide.frames->tiles[i],
+				   i % 4 == 3 || i == count - 1 ? "\n" : "");
+		printf("};\n\nstatic const struct packed_tile embedded_pack[%zu] = {\n", count);
+		for (i = 0; i < count; i++)
+			printf("%s{ %u, %u, %u },%s", i % 4 ? " " : "\t", slide.frames->pack[i].offset,
+				   slide.frames->pack[i].size, slide.frames->pack[i].see_through,
+				   i % 4 == 3 || i == count - 1 ? "\n" : "");
+		printf("};\n\n");
+	}
+
+	/* a string literal compiles far faster than a list of numbers */
+	printf("static const uint8_t embedded_data[%zu + PACK_SLACK] =\n", size);
+	for (i = 0; i < size; i += 32)
+	{
+		o = line;
+		*o++ = '\t';
+		*o++ = '"';
+		for (j = i; j < size && j < i + 32; j++)
+		{
+			*o++ = '\\';
+			*o++ = 'x';
+			*o++ = hex[data[j] >> 4];
+			*o++ = hex[data[j] & 15];
+		}
+		*o++ = '"';
+		*o = 0;
+		puts(line);
+	}
+	printf("\t;\n\nstatic const struct slide_asset embedded_splash = {\n");
+	printf("\t%u, %u, %s, %s, embedded_data, %zu,\n};\n", width, height,
+		   raw ? "NULL" : "embedded_tiles", raw ? "NULL" : "embedded_pack", size);
+
+	slide_release(&slide);
+	return fflush(stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#define BENCH_RUNS 5
+
+/*
+ * Best time of @runs calls of @fn, UINT64_MAX if one of them fails. The
+ * clock starts before each call; setup that should not count is done
+ * first and restarts it through @start.
+ */
+static uint64_t bench_best(int (*fn)(void *arg, uint64_t *start), void *arg, unsigned int runs)
+{
+	uint64_t start, end, best = UINT64_MAX;
+	unsigned int run;
+
+	for (run = 0; run < runs; run++)
+	{
+		start = get_time_ns();
+		if (fn(arg, &start))
+			return UINT64_MAX;
+		end = get_time_ns();
+		if (end - start < best)
+			best = end - start;
+	}
+	return best;
+}
+
+/* the plain copy a frame fill is measured against */
+struct bench_copy
+{
+	void *dst;
+	const void *src;
+	size_t size;
+};
+
+static int bench_memcpy(void *arg, uint64_t *start)
+{
+	struct bench_copy *copy = arg;
+
+	memcpy(copy->dst, copy->src, copy->size);
+	return 0;
+}
+
+static const struct
+{
+	uint32_t width;
+	uint32_t height;
+} bench_targets[] = {
+	{ 1280, 720 },
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+};
+
+struct bench_decode_run
+{
+	const char *path;
+	const struct modeset_buf *scanout;
+	struct slide slide;
+	long rss;
+};
+
+/* @path decoded for the scanout, the previous run's slide freed first */
+static int bench_decode_once(void *arg, uint64_t *start)
+{
+	struct bench_decode_run *decode = arg;
+
+	free(decode->slide.data);
+	memset(&decode->slide, 0, sizeof(decode->slide));
+	decode->slide.width = decode->scanout->width;
+	decode->slide.height = decode->scanout->height;
+	decode->slide.stride = decode->scanout->stride;
+	decode->slide.format = DRM_FORMAT_XRGB8888;
+
+	rss_reset_peak();
+	decode->rss = rss_read_kb("VmRSS:");
+	*start = get_time_ns();
+	return slide_load(&decode->slide, decode->path);
+}
+
+/*
+ * bootsplash -B IMAGE...: decode-to-scanout time and peak memory of each
+ * image for the common panel sizes, best of BENCH_RUNS. The scanout buffer
+ * is ordinary memory here, which makes the copy slightly faster than into
+ * a dumb buffer.
+ */
+static int bench_decode(int argc, char **argv)
+{
+	struct modeset_buf scanout;
+	struct bench_decode_run decode;
+	struct bench_copy copy;
+	uint64_t best_decode, best_fill;
+	unsigned int i, t;
+	long peak;
+
+	/* keep big blocks out of the heap so every run starts cold and RSS drops on free */
+	mallopt(M_MMAP_THRESHOLD, 128 * 1024);
+	mallopt(M_TRIM_THRESHOLD, 128 * 1024);
+
+	printf("%-32s %-10s %10s %10s %10s %12s\n", "image", "target", "decode ms", "fill ms", "total ms", "peak +kB");
+	for (i = 0; i < argc; i++)
+	{
+		for (t = 0; t < sizeof(bench_targets) / sizeof(bench_targets[0]); t++)
+		{
+			memset(&scanout, 0, sizeof(scanout));
+			scanout.width = bench_targets[t].width;
+			scanout.height = bench_targets[t].height;
+			scanout.stride = scanout.width * 4;
+			scanout.size = scanout.stride * scanout.height;
+			scanout.format = DRM_FORMAT_XRGB8888;
+			scanout.map = malloc(scanout.size);
+			if (!scanout.map)
+				return EXIT_FAILURE;
+
+			memset(&decode, 0, sizeof(decode));
+			decode.path = argv[i];
+			decode.scanout = &scanout;
+			best_decode = bench_best(bench_decode_once, &decode, BENCH_RUNS);
+			if (best_decode == UINT64_MAX)
+			{
+				fprintf(stderr, "cannot decode '%s'\n", argv[i]);
+				free(decode.slide.data);
+				free(scanout.map);
+				return EXIT_FAILURE;
+			}
+			/* of the last run, nothing was allocated since */
+			peak = rss_read_kb("VmHWM:") - decode.rss;
+
+			copy.dst = scanout.map;
+			copy.src = decode.slide.data;
+			copy.size = scanout.size;
+			best_fill = bench_best(bench_memcpy, &copy, BENCH_RUNS);
+			free(decode.slide.data);
+
+			/* the decoded slide itself is part of the peak */
+			printf("%-32s %4ux%-5u %10.2f %10.2f %10.2f %12ld\n", argv[i], scanout.width, scanout.height,
+				   best_decode / 1e6, best_fill / 1e6, (best_decode + best_fill) / 1e6, peak);
+			free(scanout.map);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+struct bench_convert_run
+{
+	uint32_t format;
+	uint8_t *dst;
+	const uint32_t *src;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+};
+
+static int bench_convert(void *arg, uint64_t *start)
+{
+	struct bench_convert_run *convert = arg;
+	uint32_t j;
+
+	for (j = 0; j < convert->height; j++)
+		convert_row(convert->format, convert->dst + (size_t)convert->stride * j,
+					convert->src + (size_t)convert->width * j, convert->width, j);
+	return 0;
+}
+
+/*
+ * Per scanout format: bytes written per frame, time to convert a decoded
+ * XRGB8888 slide when it is cached, and time to fill a frame from the cache.
+ */
+static int bench_formats(void)
+{
+	struct bench_convert_run convert;
+	struct bench_copy copy;
+	uint32_t *src, width, height, stride, j, k;
+	uint64_t best_convert, best_fill;
+	unsigned int t, f;
+	uint8_t *cache, *scanout;
+	size_t size;
+
+	printf("%-12s %-10s %12s %10s %10s\n", "format", "target", "bytes/frame", "convert ms", "fill ms");
+	for (t = 0; t < sizeof(bench_targets) / sizeof(bench_targets[0]); t++)
+	{
+		width = bench_targets[t].width;
+		height = bench_targets[t].height;
+		src = malloc((size_t)width * height * 4);
+		if (!src)
+			return EXIT_FAILURE;
+		for (j = 0; j < height; j++)
+			for (k = 0; k < width; k++)
+				src[j * width + k] = ((k * 255 / width) << 16) | ((j * 255 / height) << 8) | ((j + k) & 0xff);
+
+		for (f = 0; f < sizeof(pixel_formats) / sizeof(pixel_formats[0]); f++)
+		{
+			stride = width * pixel_formats[f].bpp / 8;
+			size = (size_t)stride * height;
+			cache = malloc(size);
+			scanout = malloc(size);
+			if (!cache || !scanout)
+			{
+				free(cache);
+				free(scanout);
+				free(src);
+				return EXIT_FAILURE;
+			}
+			memset(scanout, 0, size);
+
+			convert.format = pixel_formats[f].format;
+			convert.dst = cache;
+			convert.src = src;
+			convert.width = width;
+			convert.height = height;
+			convert.stride = stride;
+			best_convert = bench_best(bench_convert, &convert, BENCH_RUNS);
+
+			copy.dst = scanout;
+			copy.src = cache;
+			copy.size = size;
+			best_fill = bench_best(bench_memcpy, &copy, BENCH_RUNS);
+
+			printf("%-12s %4ux%-5u %12zu %10.2f %10.2f\n", pixel_formats[f].name, width, height,
+				   size, best_convert / 1e6, best_fill / 1e6);
+			free(cache);
+			free(scanout);
+		}
+		free(src);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* -R [CONNECTOR:]DEGREES[x][y] */
+static int parse_rotation(const char *arg)
+{
+	unsigned long connector_id = 0;
+	const char *p = arg;
+	uint32_t rotation;
+	char *end;
+
+	if (rotation_count == ROTATION_MAX)
+		goto err;
+
+	if (strchr(arg, ':'))
+	{
+		connector_id = strtoul(p, &end, 10);
+		if (end == p || *end != ':')
+			goto err;
+		p = end + 1;
+	}
+
+	switch (strtoul(p, &end, 10))
+	{
+	case 0:
+		rotation = DRM_MODE_ROTATE_0;
+		break;
+	case 90:
+		rotation = DRM_MODE_ROTATE_90;
+		break;
+	case 180:
+		rotation = DRM_MODE_ROTATE_180;
+		break;
+	case 270:
+		rotation = DRM_MODE_ROTATE_270;
+		break;
+	default:
+		goto err;
+	}
+	if (end == p)
+		goto err;
+
+	for (; *end; end++)
+	{
+		if (*end == 'x')
+			rotation |= DRM_MODE_REFLECT_X;
+		else if (*end == 'y')
+			rotation |= DRM_MODE_REFLECT_Y;
+		else
+			goto err;
+	}
+
+	rotation_settings[rotation_count].connector_id = connector_id;
+	rotation_settings[rotation_count].rotation = rotation;
+	rotation_count++;
+	return 0;
+
+err:
+	fprintf(stderr, "invalid rotation '%s'\n", arg);
+	return -EINVAL;
+}
+
+/* -F xrgb8888,rgb565,... */
+static int parse_format_policy(const char *arg)
+{
+	char list[64], *name, *save;
+	unsigned int i, count = 0;
+
+	snprintf(list, sizeof(list), "%s", arg);
+	for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save))
+	{
+		for (i = 0; i < sizeof(pixel_formats) / sizeof(pixel_formats[0]); i++)
+		{
+			if (!strcmp(name, pixel_formats[i].name))
+				break;
+		}
+		if (i == sizeof(pixel_formats) / sizeof(pixel_formats[0]) || count == FORMAT_POLICY_MAX)
+		{
+			fprintf(stderr, "invalid format list '%s'\n", arg);
+			return -EINVAL;
+		}
+		format_policy[count++] = pixel_formats[i].format;
+	}
+
+	if (!count)
+		return -EINVAL;
+	format_policy_count = count;
+	return 0;
+}
+
+/* a decimal number of 0..@max, strtoul() alone would take "-1" as ULONG_MAX */
+static int parse_number(const char *arg, unsigned long max, unsigned long *value)
+{
+	char *end;
+
+	errno = 0;
+	*value = strtoul(arg, &end, 10);
+	if (arg[0] < '0' || arg[0] > '9' || *end || errno || *value > max)
+	{
+		fprintf(stderr, "invalid number '%s'\n", arg);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* ":RRGGBB" at *@p */
+static bool parse_color(const char **p, uint32_t *color)
+{
+	if (**p != ':' || strspn(*p + 1, "0123456789abcdefABCDEF") != 6)
+		return false;
+	*color = strtoul(*p + 1, NULL, 16);
+	*p += 7;
+	return true;
+}
+
+/*
+ * -b solid:RRGGBB | linear:RRGGBB:RRGGBB[:DEGREES] | radial:RRGGBB:RRGGBB
+ *    | cycle:RRGGBB:RRGGBB[:SECONDS]
+ */
+static int parse_background(const char *arg)
+{
+	static const char *const kinds[] = {
+		[BACKGROUND_SOLID] = "solid",
+		[BACKGROUND_LINEAR] = "linear",
+		[BACKGROUND_RADIAL] = "radial",
+		[BACKGROUND_CYCLE] = "cycle",
+	};
+	unsigned int kind;
+	const char *p;
+	double value;
+	char *end;
+
+	p = strchr(arg, ':');
+	if (!p)
+		goto err;
+	for (kind = BACKGROUND_SOLID; kind <= BACKGROUND_CYCLE; kind++)
+	{
+		if (strlen(kinds[kind]) == (size_t)(p - arg) && !strncmp(arg, kinds[kind], p - arg))
+			break;
+	}
+	if (kind > BACKGROUND_CYCLE || !parse_color(&p, &background.from))
+		goto err;
+	background.to = background.from;
+	if (kind != BACKGROUND_SOLID && !parse_color(&p, &background.to))
+		goto err;
+
+	/* top to bottom, and there and back every 20 seconds */
+	background.angle = 90;
+	background.cycle_ns = 20 * NSEC_PER_SEC;
+	if (*p == ':' && (kind == BACKGROUND_LINEAR || kind == BACKGROUND_CYCLE))
+	{
+		value = strtod(p + 1, &end);
+		/* negated so that NaN fails too */
+		if (end == p + 1 || (kind == BACKGROUND_LINEAR && !(fabs(value) <= BACKGROUND_ANGLE_MAX)) ||
+			(kind == BACKGROUND_CYCLE && !(value >= BACKGROUND_CYCLE_MIN && value <= BACKGROUND_CYCLE_MAX)))
+			goto err;
+		if (kind == BACKGROUND_LINEAR)
+			background.angle = value;
+		else
+			background.cycle_ns = value * NSEC_PER_SEC;
+		p = end;
+	}
+	if (*p)
+		goto err;
+
+	background.kind = kind;
+	return 0;
+
+err:
+	fprintf(stderr, "invalid background '%s'\n", arg);
+	return -EINVAL;
+}
+
+/* naive per-pixel 90 degree rotation, the baseline for rotate_xrgb() */
+static void rotate_naive_90(uint32_t *dst, const uint32_t *src, uint32_t width, uint32_t height)
+{
+	uint32_t x, y;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			dst[(size_t)(width - 1 - x) * height + y] = src[(size_t)width * y + x];
+}
+
+struct bench_rotation
+{
+	uint32_t *dst;
+	const uint32_t *src;
+	uint32_t width;
+	uint32_t height;
+};
+
+static int bench_rotate_naive(void *arg, uint64_t *start)
+{
+	struct bench_rotation *rot = arg;
+
+	rotate_naive_90(rot->dst, rot->src, rot->width, rot->height);
+	return 0;
+}
+
+static int bench_rotate_tiled(void *arg, uint64_t *start)
+{
+	struct bench_rotation *rot = arg;
+
+	rotate_xrgb(rot->dst, rot->height, rot->src, rot->width, rot->height, rot->width, DRM_MODE_ROTATE_90);
+	return 0;
+}
+
+/* the same as a pushed or streamed frame drawn to a panel the plane cannot rotate */
+static int bench_rotate_blit(void *arg, uint64_t *start)
+{
+	struct bench_rotation *rot = arg;
+	struct modeset_buf buf;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.width = rot->height;
+	buf.height = rot->width;
+	buf.stride = buf.width * 4;
+	buf.format = DRM_FORMAT_XRGB8888;
+	buf.map = (uint8_t *)rot->dst;
+	modeset_blit_xrgb(&buf, (const uint8_t *)rot->src, rot->width, rot->height, rot->width * 4, DRM_MODE_ROTATE_90);
+	return 0;
+}
+
+/*
+ * Portrait slides rotated for landscape scanouts of every bench target.
+ * The naive loop writes a column per source row, which misses the cache
+ * more the larger the slide; at 4K the tiled kernel is about twice as fast.
+ * Frames blitted over the slides take the tiled kernel too, in bands.
+ */
+static int bench_rotate(void)
+{
+	struct bench_rotation rot;
+	uint32_t *src = NULL, *naive = NULL, *tiled = NULL, width, height, i;
+	uint64_t best_naive, best_tiled, best_blit;
+	unsigned int t;
+	int ret = EXIT_SUCCESS;
+
+	for (t = 0; t < sizeof(bench_targets) / sizeof(bench_targets[0]) && ret == EXIT_SUCCESS; t++)
+	{
+		width = bench_targets[t].height;
+		height = bench_targets[t].width;
+		src = malloc((size_t)width * height * 4);
+		naive = malloc((size_t)width * height * 4);
+		tiled = malloc((size_t)width * height * 4);
+		if (!src || !naive || !tiled)
+		{
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+		for (i = 0; i < width * height; i++)
+			src[i] = i * 2654435761u;
+		memset(naive, 0, (size_t)width * height * 4);
+		memset(tiled, 0, (size_t)width * height * 4);
+
+		/* each kernel runs back to back, so neither sees the other's cache state */
+		rot.src = src;
+		rot.width = width;
+		rot.height = height;
+		rot.dst = naive;
+		best_naive = bench_best(bench_rotate_naive, &rot, BENCH_RUNS * 4);
+		rot.dst = tiled;
+		best_tiled = bench_best(bench_rotate_tiled, &rot, BENCH_RUNS * 4);
+
+		if (memcmp(naive, tiled, (size_t)width * height * 4))
+		{
+			fprintf(stderr, "rotate_xrgb() does not match the naive rotation\n");
+			ret = EXIT_FAILURE;
+		}
+
+		memset(tiled, 0, (size_t)width * height * 4);
+		best_blit = bench_best(bench_rotate_blit, &rot, BENCH_RUNS * 4);
+		if (memcmp(naive, tiled, (size_t)width * height * 4))
+		{
+			fprintf(stderr, "a rotated frame blit does not match the naive rotation\n");
+			ret = EXIT_FAILURE;
+		}
+		printf("rotate 90 %ux%u: naive %.2f ms, tiled %.2f ms, frame blit %.2f ms\n", width, height,
+			   best_naive / 1e6, best_tiled / 1e6, best_blit / 1e6);
+
+		free(src);
+		free(naive);
+		free(tiled);
+		src = naive = tiled = NULL;
+	}
+
+out:
+	free(src);
+	free(naive);
+	free(tiled);
+	return ret;
+}
+
+/* fresh copy of @raw in @slide, packed again */
+static int bench_pack(struct slide *slide, const uint8_t *raw, size_t size)
+{
+	slide_release(slide);
+	slide->data = malloc(size);
+	if (!slide->data)
+		return -ENOMEM;
+	memcpy(slide->data, raw, size);
+	return slide_pack_frame(slide, NULL, 0);
+}
+
+struct bench_packing
+{
+	struct slide *slide;
+	const uint8_t *raw;
+	size_t size;
+};
+
+static int bench_repack(void *arg, uint64_t *start)
+{
+	struct bench_packing *pack = arg;
+
+	return bench_pack(pack->slide, pack->raw, pack->size);
+}
+
+/* a 1920x1080 slide where @variant changes the logo and the progress bar */
+static void bench_pattern(uint32_t *raw, uint32_t width, uint32_t height, unsigned int variant)
+{
+	uint32_t x, y;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			raw[y * width + x] = 0xff000000 | ((x >> 3) << 16) | ((y >> 3) << 8);
+	for (y = 400; y < 600; y++)
+		for (x = 860; x < 1060; x++)
+			raw[y * width + x] = variant ? 0xffffffff : 0xff3050a0;
+	for (y = 980; y < 1010; y++)
+		for (x = 480; x < 480 + 240 * (variant + 1); x++)
+			raw[y * width + x] = 0xffffffff;
+}
+
+struct bench_switch
+{
+	struct modeset_buf *buf;
+	struct slide *slides;
+	unsigned int run;
+	size_t written;
+};
+
+/* the other one of two slides drawn over the one @buf shows */
+static int bench_switch_slide(void *arg, uint64_t *start)
+{
+	struct bench_switch *sw = arg;
+
+	sw->written = modeset_draw_base(sw->buf, &sw->slides[sw->run++ & 1 ? 0 : 1], 0, NULL, NULL);
+	return 0;
+}
+
+/*
+ * Switch between two 1080p slides that differ only in a logo and a
+ * progress bar, tile diffing against a full copy.
+ */
+static int bench_tiles(void)
+{
+	struct slide slides[2];
+	struct modeset_buf buf;
+	struct bench_packing pack;
+	struct bench_switch sw;
+	struct bench_copy copy;
+	uint64_t best_pack = UINT64_MAX, best_diff, best_full, t;
+	uint32_t i, *raw[2] = { NULL, NULL };
+	size_t size;
+	int ret = EXIT_FAILURE;
+
+	memset(&buf, 0, sizeof(buf));
+	memset(slides, 0, sizeof(slides));
+	buf.width = 1920;
+	buf.height = 1080;
+	buf.stride = buf.width * 4;
+	buf.format = DRM_FORMAT_XRGB8888;
+	buf.tiles_x = (buf.width + TILE_SIZE - 1) / TILE_SIZE;
+	buf.tiles_y = (buf.height + TILE_SIZE - 1) / TILE_SIZE;
+	size = (size_t)buf.stride * buf.height;
+	buf.map = calloc(1, size);
+	buf.tiles = calloc(buf.tiles_x * buf.tiles_y, sizeof(*buf.tiles));
+	if (!buf.map || !buf.tiles)
+		goto out;
+
+	for (i = 0; i < 2; i++)
+	{
+		slides[i].width = buf.width;
+		slides[i].height = buf.height;
+		slides[i].stride = buf.stride;
+		slides[i].format = buf.format;
+		raw[i] = malloc(size);
+		if (!raw[i])
+			goto out;
+		bench_pattern(raw[i], buf.width, buf.height, i);
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		pack.slide = &slides[i];
+		pack.raw = (const uint8_t *)raw[i];
+		pack.size = size;
+		t = bench_best(bench_repack, &pack, BENCH_RUNS);
+		if (t == UINT64_MAX)
+			goto out;
+		if (t < best_pack)
+			best_pack = t;
+	}
+
+	modeset_draw_base(&buf, &slides[0], 0, NULL, NULL);
+	sw.buf = &buf;
+	sw.slides = slides;
+	sw.run = 0;
+	sw.written = 0;
+	best_diff = bench_best(bench_switch_slide, &sw, BENCH_RUNS);
+
+	copy.dst = buf.map;
+	copy.src = raw[0];
+	copy.size = size;
+	best_full = bench_best(bench_memcpy, &copy, BENCH_RUNS);
+
+	printf("slide switch 1920x1080: tiles wrote %zu of %zu bytes in %.2f ms, full copy %.2f ms, "
+		   "hash and pack %.2f ms per slide (%.1f:1)\n", sw.written, size, best_diff / 1e6, best_full / 1e6,
+		   best_pack / 1e6, (double)size / slides[0].packed_size);
+	ret = EXIT_SUCCESS;
+
+out:
+	for (i = 0; i < 2; i++)
+	{
+		slide_release(&slides[i]);
+		free(raw[i]);
+	}
+	free(buf.map);
+	free(buf.tiles);
+	return ret;
+}
+
+struct bench_backdrop
+{
+	struct modeset_buf *buf;
+	struct background_geom bg;
+	unsigned int frames;
+};
+
+/* a frame of the current background, colors swapped every frame as a cycle does */
+static int bench_background_frame(void *arg, uint64_t *start)
+{
+	struct bench_backdrop *back = arg;
+
+	back->frames++;
+	background_setup(&back->bg, back->buf, DRM_MODE_ROTATE_0, back->frames & 1 ? 0x102040 : 0x204080,
+					 back->frames & 1 ? 0xd0a070 : 0xa07050);
+	*start = get_time_ns();
+	modeset_draw_base(back->buf, NULL, 0, &back->bg, NULL);
+	return 0;
+}
+
+static int bench_memset(void *arg, uint64_t *start)
+{
+	struct bench_copy *copy = arg;
+
+	memset(copy->dst, 0x55, copy->size);
+	return 0;
+}
+
+/*
+ * Full 4K frames of each background kind, with the colors swapped every
+ * frame as a cycle does, on the calling thread and on the render pool,
+ * against a plain memset of the frame.
+ */
+static int bench_background(void)
+{
+	static const enum background_kind kinds[] = { BACKGROUND_SOLID, BACKGROUND_LINEAR, BACKGROUND_RADIAL };
+	static const char *const names[] = { "solid", "linear", "radial" };
+	struct bench_backdrop back;
+	struct bench_copy fill;
+	struct modeset_buf buf;
+	uint64_t best[2], best_fill;
+	unsigned int pass, k, workers = 0;
+	size_t size;
+	int ret = EXIT_FAILURE;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.width = 3840;
+	buf.height = 2160;
+	buf.stride = buf.width * 4;
+	buf.format = DRM_FORMAT_XRGB8888;
+	buf.tiles_x = (buf.width + TILE_SIZE - 1) / TILE_SIZE;
+	buf.tiles_y = (buf.height + TILE_SIZE - 1) / TILE_SIZE;
+	size = (size_t)buf.stride * buf.height;
+	buf.map = calloc(1, size);
+	buf.tiles = calloc(buf.tiles_x * buf.tiles_y, sizeof(*buf.tiles));
+	if (!buf.map || !buf.tiles)
+		goto out;
+
+	fill.dst = buf.map;
+	fill.src = NULL;
+	fill.size = size;
+	best_fill = bench_best(bench_memset, &fill, BENCH_RUNS);
+
+	memset(&back, 0, sizeof(back));
+	back.buf = &buf;
+	background.angle = 30;
+	for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+	{
+		background.kind = kinds[k];
+		for (pass = 0; pass < 2; pass++)
+		{
+			if (pass)
+			{
+				render_pool_start(render_threads);
+				workers = render_pool.threads_count;
+				/* without workers the pool is the calling thread again */
+				if (!workers)
+				{
+					render_pool_stop();
+					break;
+				}
+			}
+			best[pass] = bench_best(bench_background_frame, &back, BENCH_RUNS);
+			if (pass)
+				render_pool_stop();
+		}
+		if (workers)
+			printf("background %-6s 3840x2160: %.2f ms, %.2f ms with %u threads\n", names[k],
+				   best[0] / 1e6, best[1] / 1e6, workers + 1);
+		else
+			printf("background %-6s 3840x2160: %.2f ms\n", names[k], best[0] / 1e6);
+	}
+	printf("background memset 3840x2160: %.2f ms\n", best_fill / 1e6);
+	ret = EXIT_SUCCESS;
+
+out:
+	memset(&background, 0, sizeof(background));
+	free(buf.map);
+	free(buf.tiles);
+	return ret;
+}
+
+struct bench_unpacking
+{
+	struct modeset_buf *buf;
+	const struct slide *slide;
+};
+
+static int bench_unpack(void *arg, uint64_t *start)
+{
+	struct bench_unpacking *unpack = arg;
+	unsigned int i;
+
+	/* every tile unknown, so every tile is unpacked */
+	for (i = 0; i < unpack->buf->tiles_x * unpack->buf->tiles_y; i++)
+		unpack->buf->tiles[i] = TILE_UNKNOWN;
+	*start = get_time_ns();
+	modeset_draw_base(unpack->buf, unpack->slide, 0, NULL, NULL);
+	return 0;
+}
+
+/* compression ratio and unpack throughput of decoded images in the slide cache */
+static int bench_store(int argc, char **argv)
+{
+	struct modeset_buf buf;
+	struct slide slide;
+	struct bench_packing pack;
+	struct bench_unpacking unpack;
+	struct bench_copy copy;
+	uint64_t best_pack, best_unpack, best_copy;
+	uint8_t *raw;
+	size_t size;
+	int arg, ret;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.width = 1920;
+	buf.height = 1080;
+	buf.stride = buf.width * 4;
+	buf.format = DRM_FORMAT_XRGB8888;
+	buf.tiles_x = (buf.width + TILE_SIZE - 1) / TILE_SIZE;
+	buf.tiles_y = (buf.height + TILE_SIZE - 1) / TILE_SIZE;
+	size = (size_t)buf.stride * buf.height;
+	buf.map = calloc(1, size);
+	buf.tiles = calloc(buf.tiles_x * buf.tiles_y, sizeof(*buf.tiles));
+	if (!buf.map || !buf.tiles)
+	{
+		free(buf.map);
+		free(buf.tiles);
+		return EXIT_FAILURE;
+	}
+
+	printf("%-32s %10s %10s %7s %9s %12s %12s\n", "image", "raw kB", "packed kB", "ratio", "pack ms",
+		   "unpack GB/s", "memcpy GB/s");
+	for (arg = 0; arg < argc; arg++)
+	{
+		memset(&slide, 0, sizeof(slide));
+		slide.width = buf.width;
+		slide.height = buf.height;
+		slide.stride = buf.stride;
+		slide.format = buf.format;
+		ret = slide_load(&slide, argv[arg]);
+		if (ret)
+		{
+			fprintf(stderr, "cannot load '%s': %s\n", argv[arg], strerror(-ret));
+			continue;
+		}
+		raw = slide.data;
+		slide.data = NULL;
+
+		pack.slide = &slide;
+		pack.raw = raw;
+		pack.size = size;
+		best_pack = bench_best(bench_repack, &pack, BENCH_RUNS);
+		if (best_pack != UINT64_MAX)
+		{
+			unpack.buf = &buf;
+			unpack.slide = &slide;
+			best_unpack = bench_best(bench_unpack, &unpack, BENCH_RUNS);
+
+			copy.dst = buf.map;
+			copy.src = raw;
+			copy.size = size;
+			best_copy = bench_best(bench_memcpy, &copy, BENCH_RUNS);
+
+			printf("%-32s %10zu %10zu %6.1f:1 %9.2f %12.2f %12.2f\n", argv[arg], size / 1024,
+				   slide.packed_size / 1024, (double)size / slide.packed_size, best_pack / 1e6,
+				   (double)size / best_unpack, (double)size / best_copy);
+		}
+		free(raw);
+		slide_release(&slide);
+	}
 
-    return add_sig.sa_handler;
+	free(buf.map);
+	free(buf.tiles);
+	return EXIT_SUCCESS;
 }
 
-static inline void catchsignals()
+struct bench_cold
 {
-    if (sig_install_handler(SIGUSR1, signal_handler) == SIG_ERR) {
-        return -EINVAL;
-    }
-    if (sig_install_handler(SIGUSR2, signal_handler) == SIG_ERR) {
-        return -EINVAL;
-    }
-    if (sig_install_handler(SIGTERM, signal_handler) == SIG_ERR) {
-        return -EINVAL;
-    }
-}
-#endif
+	struct modeset_buf *buf;
+	const char *path;
+	const struct slide_asset *asset;
+	struct slide slide;
+};
 
-static int fd_epoll;
-static int register_signals(sigset_t* prevSigset, sigset_t* newSigset)
+/* cold start of one 1080p frame from an empty cache, all tiles unknown */
+static int bench_first(void *arg, uint64_t *start)
 {
-    struct epoll_event event;
-    sigset_t mask;
-    int sfd;
+	struct bench_cold *cold = arg;
+	struct modeset_buf *buf = cold->buf;
+	unsigned int i;
+	int ret;
 
-    sigemptyset(newSigset);
-    sigemptyset(prevSigset);
+	slide_release(&cold->slide);
+	memset(&cold->slide, 0, sizeof(cold->slide));
+	cold->slide.width = buf->width;
+	cold->slide.height = buf->height;
+	cold->slide.stride = buf->stride;
+	cold->slide.format = buf->format;
+	for (i = 0; i < buf->tiles_x * buf->tiles_y; i++)
+		buf->tiles[i] = TILE_UNKNOWN;
+
+	*start = get_time_ns();
+	ret = cold->path ? slide_open(&cold->slide, cold->path) : slide_open_asset(&cold->slide, cold->asset);
+	if (ret == 0)
+		modeset_draw_base(buf, &cold->slide, 0, NULL, NULL);
+	return ret;
+}
 
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigaddset(&mask, SIGHUP);
-    sigaddset(&mask, SIGUSR1);
-    sigaddset(&mask, SIGUSR2);
-    sigaddset(&mask, SIGKILL);
-    sigaddset(&mask, SIGTERM);
+/* best of BENCH_RUNS cold starts from @path or @asset */
+static uint64_t bench_first_best(struct modeset_buf *buf, const char *path, const struct slide_asset *asset)
+{
+	struct bench_cold cold;
+	uint64_t best;
+
+	memset(&cold, 0, sizeof(cold));
+	cold.buf = buf;
+	cold.path = path;
+	cold.asset = asset;
+	best = bench_best(bench_first, &cold, BENCH_RUNS);
+	slide_release(&cold.slide);
+	return best;
+}
 
-    if (sigprocmask(SIG_SETMASK, &mask, prevSigset) == -1) {
-        fprintf(stderr, "Failed to setup signal proc mask!\n");
-        return -EINVAL;
-    }
+/*
+ * Time from nothing to the first 1080p frame of each image, opened as
+ * a file and as the built-in asset 'make EMBED=IMAGE' would make of it,
+ * best of BENCH_RUNS. The asset is packed up front, as the build does.
+ */
+static int bench_first_frame(int argc, char **argv)
+{
+	struct modeset_buf buf;
+	struct slide_asset asset;
+	struct slide packed;
+	uint64_t best_file, best_asset;
+	int arg;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.width = 1920;
+	buf.height = 1080;
+	buf.stride = buf.width * 4;
+	buf.format = DRM_FORMAT_XRGB8888;
+	buf.tiles_x = (buf.width + TILE_SIZE - 1) / TILE_SIZE;
+	buf.tiles_y = (buf.height + TILE_SIZE - 1) / TILE_SIZE;
+	buf.map = calloc(buf.height, buf.stride);
+	buf.tiles = calloc(buf.tiles_x * buf.tiles_y, sizeof(*buf.tiles));
+	if (!buf.map || !buf.tiles)
+	{
+		free(buf.map);
+		free(buf.tiles);
+		return EXIT_FAILURE;
+	}
 
-    sfd = signalfd(-1, &mask, SFD_NONBLOCK);
-    if (sfd == -1) {
-        fprintf(stderr, "Failed to get signal fd!\n");
-        return -EINVAL;
-    }
+	printf("%-32s %10s %12s\n", "first frame 1920x1080", "file ms", "built-in ms");
+	for (arg = 0; arg < argc; arg++)
+	{
+		memset(&packed, 0, sizeof(packed));
+		packed.width = buf.width;
+		packed.height = buf.height;
+		packed.stride = buf.stride;
+		packed.format = buf.format;
+		if (slide_load(&packed, argv[arg]) || slide_pack_frame(&packed, NULL, 0))
+		{
+			fprintf(stderr, "cannot load '%s'\n", argv[arg]);
+			slide_release(&packed);
+			continue;
+		}
+		slide_pack_done(&packed);
+		asset.width = packed.width;
+		asset.height = packed.height;
+		asset.tiles = packed.frames->tiles;
+		asset.pack = packed.frames->pack;
+		asset.data = packed.packed;
+		asset.size = packed.packed_size;
+
+		best_file = bench_first_best(&buf, argv[arg], NULL);
+		best_asset = bench_first_best(&buf, NULL, &asset);
+		printf("%-32s %10.2f %12.2f\n", argv[arg], best_file / 1e6, best_asset / 1e6);
+		slide_release(&packed);
+	}
 
-    /* Add fd to be monitored by epoll */
-    event.events = EPOLLIN;
-    event.data.fd = sfd;
-    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, sfd, &event) == -1) {
-        fprintf(stderr, "Failed to register signal: %d\n", sfd);
-        close(sfd);
-        return -EINVAL;
-    }
+#ifdef EMBEDDED_SPLASH
+	best_asset = bench_first_best(&buf, NULL, &embedded_splash);
+	printf("%-32s %10s %12.2f\n", "(built into this binary)", "-", best_asset / 1e6);
+#endif
 
-    (*newSigset) = mask;
-    return sfd;
+	free(buf.map);
+	free(buf.tiles);
+	return EXIT_SUCCESS;
 }
 
-static int fd_signals;
-static sigset_t g_sigset_prev;
-static sigset_t g_sigset_new;
+#define BENCH_HEADS 4
 
-static inline int catch_signals()
-{    
-	/* allocate epoll file descriptor */
-    fd_epoll = epoll_create(6);
-    if (fd_epoll < 0) {
-        return -EINVAL;
-    }
+struct bench_frame
+{
+	struct modeset_device *heads;
+	struct slide *slides;
+	unsigned int n;
+	unsigned int run;
+};
 
-    /* monitor process signals, so we can terminate thread
-     * loop with registred SIGxxx signals. This terminates
-     * the CarIOS main process with SIGINT too. */
-    if ((fd_signals = register_signals(&g_sigset_prev, &g_sigset_new)) < 0) {
-        fprintf(stderr, "Failed to register signals. err=%d\n", errno);
-        close(fd_epoll);
-        fd_epoll = -1;
-        return -EINVAL;
-    }
+/* every head flips and draws the next slide, each back buffer still shows the other one */
+static int bench_heads_frame(void *arg, uint64_t *start)
+{
+	struct bench_frame *frame = arg;
+	unsigned int i;
 
+	for (i = 0; i < frame->n; i++)
+	{
+		frame->heads[i].front_buf = frame->run & 1;
+		frame->heads[i].draw_slide = &frame->slides[(frame->run / 2) & 1];
+	}
+	frame->run++;
+	*start = get_time_ns();
+	render_run(render_device_task, frame->heads, frame->n);
 	return 0;
 }
 
-/* check epoll event error flags  */
-static int check_event_flags(unsigned long flags)
+/*
+ * Frame time of 1..BENCH_HEADS 1080p outputs that all switch slides and
+ * draw the countdown overlay in the same vblank, rendered one after the
+ * other and on the render pool. Buffers are plain memory, so this is the
+ * render cost alone, as on vkms or a headless setup.
+ */
+static int bench_heads(void)
 {
-    bool result = 0;
-    if (!(flags & EPOLLIN) && ((flags & EPOLLERR) || (flags & EPOLLHUP))) {
-        if (flags & EPOLLERR) {
-            fprintf(stderr, "EPOLLERR detected.\n");
-            result = -EINVAL;
-        }
-        if (flags & EPOLLHUP) {
-            fprintf(stderr, "EPOLLHUP detected.\n");
-            result = -EINVAL;
-        }
-    }
-    return result;
+	struct modeset_device heads[BENCH_HEADS];
+	struct slide slides[2];
+	struct modeset_buf *buf;
+	struct bench_frame frame;
+	uint32_t *raw = NULL;
+	uint64_t best[2][BENCH_HEADS];
+	unsigned int i, j, n, pass, workers = 0;
+	size_t size;
+	int ret = EXIT_FAILURE;
+
+	memset(heads, 0, sizeof(heads));
+	memset(slides, 0, sizeof(slides));
+	size = (size_t)1920 * 1080 * 4;
+	raw = malloc(size);
+	if (!raw)
+		goto out;
+	for (i = 0; i < 2; i++)
+	{
+		slides[i].width = 1920;
+		slides[i].height = 1080;
+		slides[i].stride = 1920 * 4;
+		slides[i].format = DRM_FORMAT_XRGB8888;
+		bench_pattern(raw, 1920, 1080, i);
+		/* unlike a progress step, a slide change touches every tile */
+		for (j = 0; i && j < 1920 * 1080; j++)
+			raw[j] ^= 0x00ffffff;
+		if (bench_pack(&slides[i], (const uint8_t *)raw, size))
+			goto out;
+	}
+
+	for (i = 0; i < BENCH_HEADS; i++)
+	{
+		heads[i].mode.hdisplay = 1920;
+		heads[i].mode.vdisplay = 1080;
+		heads[i].sw_rotation = heads[i].rotation = DRM_MODE_ROTATE_0;
+		heads[i].last_slide = -1;
+		heads[i].draw_countdown = 3;
+		for (j = 0; j < 2; j++)
+		{
+			buf = &heads[i].bufs[j];
+			buf->width = 1920;
+			buf->height = 1080;
+			buf->stride = buf->width * 4;
+			buf->format = DRM_FORMAT_XRGB8888;
+			buf->tiles_x = (buf->width + TILE_SIZE - 1) / TILE_SIZE;
+			buf->tiles_y = (buf->height + TILE_SIZE - 1) / TILE_SIZE;
+			buf->map = calloc(1, size);
+			buf->tiles = calloc(buf->tiles_x * buf->tiles_y, sizeof(*buf->tiles));
+			if (!buf->map || !buf->tiles)
+				goto out;
+			buf->surface = cairo_image_surface_create_for_data(buf->map, CAIRO_FORMAT_RGB24, buf->width,
+															   buf->height, buf->stride);
+			buf->cr = cairo_create(buf->surface);
+		}
+	}
+
+	/* pass 0 renders on the calling thread only */
+	for (pass = 0; pass < 2; pass++)
+	{
+		if (pass)
+		{
+			render_pool_start(render_threads);
+			workers = render_pool.threads_count;
+			/* without workers the pool is the calling thread again */
+			if (!workers)
+			{
+				render_pool_stop();
+				break;
+			}
+		}
+		for (n = 1; n <= BENCH_HEADS; n++)
+		{
+			for (i = 0; i < n; i++)
+			{
+				heads[i].next = i + 1 < n ? &heads[i + 1] : NULL;
+				heads[i].draw_due = true;
+			}
+			frame.heads = heads;
+			frame.slides = slides;
+			frame.n = n;
+			frame.run = 0;
+			/* the first two frames only fill both buffers */
+			bench_best(bench_heads_frame, &frame, 2);
+			best[pass][n - 1] = bench_best(bench_heads_frame, &frame, 2 * BENCH_RUNS - 2);
+		}
+		if (pass)
+			render_pool_stop();
+	}
+
+	if (workers)
+		printf("heads   1 thread ms   %u threads ms   speedup\n", workers + 1);
+	else
+		printf("heads   1 thread ms   (no render workers, give -j)\n");
+	for (n = 1; n <= BENCH_HEADS; n++)
+	{
+		if (workers)
+			printf("%5u %13.2f %15.2f %8.2fx\n", n, best[0][n - 1] / 1e6, best[1][n - 1] / 1e6,
+				   (double)best[0][n - 1] / best[1][n - 1]);
+		else
+			printf("%5u %13.2f\n", n, best[0][n - 1] / 1e6);
+	}
+	ret = EXIT_SUCCESS;
+
+out:
+	for (i = 0; i < BENCH_HEADS; i++)
+	{
+		for (j = 0; j < 2; j++)
+		{
+			buf = &heads[i].bufs[j];
+			if (buf->cr)
+				cairo_destroy(buf->cr);
+			if (buf->surface)
+				cairo_surface_destroy(buf->surface);
+			free(buf->map);
+			free(buf->tiles);
+		}
+	}
+	for (i = 0; i < 2; i++)
+		slide_release(&slides[i]);
+	free(raw);
+	return ret;
 }
 
-static int should_terminate(const int fd)
+/* bootsplash -B [IMAGE...] */
+static int bench_run(int argc, char **argv)
 {
-    struct signalfd_siginfo sfd_si;
-    int ret;
+	int ret = EXIT_SUCCESS;
 
-    /* read signals */
-    while ((ret = read(fd, &sfd_si, sizeof(sfd_si)))) {
+	if (argc > 0)
+	{
+		ret = bench_decode(argc, argv);
+		printf("\n");
+		if (ret == EXIT_SUCCESS)
+			ret = bench_store(argc, argv);
+		printf("\n");
+		if (ret == EXIT_SUCCESS)
+			ret = bench_first_frame(argc, argv);
+		printf("\n");
+	}
+	if (ret == EXIT_SUCCESS)
+		ret = bench_formats();
+	if (ret == EXIT_SUCCESS)
+	{
+		printf("\n");
+		ret = bench_rotate();
+	}
+	if (ret == EXIT_SUCCESS)
+		ret = bench_tiles();
+	if (ret == EXIT_SUCCESS)
+	{
+		printf("\n");
+		ret = bench_heads();
+	}
+	if (ret == EXIT_SUCCESS)
+	{
+		printf("\n");
+		ret = bench_background();
+	}
 
-        if (ret <= 0)
-            break;
+	return ret;
+}
 
-        switch (sfd_si.ssi_signo) {
-			case SIGHUP:
-			case SIGUSR1:
-			case SIGUSR2:
-            case SIGTERM:
-            case SIGKILL:
-            case SIGINT: {
-                fprintf(stderr, "Terminate signal: %d\n", sfd_si.ssi_signo);
-				return 1;
-            }
-            default: {
-                fprintf(stderr, "Unhandled signal: %d\n", sfd_si.ssi_signo);
-            }
-        }
-    }
-    return 0;
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+			"usage: %s [-F FORMAT[,FORMAT...]] [-S PERCENT] [-R ROTATION]... [-b BACKGROUND] [-M MB] [-P PRIO] [-j N] [-L N] [-H] [-s SOURCE [-f xrgb8888|nv12] [-g WxH]] [card]\n"
+			"       %s -c slide N | progress N|off | text STRING | handoff | quit\n"
+			"       %s -G WxH [fps]\n"
+			"       %s -E WxH IMAGE [raw]\n"
+			"       %s -B [IMAGE...]\n"
+			"  -F LIST    scanout formats in order of preference, default xrgb8888,rgb565\n"
+			"             (xrgb8888, rgb565, xrgb2101010)\n"
+			"  -S PERCENT render at a fraction of the mode and let the plane upscale\n"
+			"  -R [CONNECTOR:]DEGREES[x][y]\n"
+			"             rotate counter-clockwise by 0, 90, 180 or 270 after reflecting\n"
+			"             along x and/or y, for one connector id or all of them\n"
+			"  -b solid:RRGGBB | linear:RRGGBB:RRGGBB[:DEGREES] | radial:RRGGBB:RRGGBB\n"
+			"     | cycle:RRGGBB:RRGGBB[:SECONDS]\n"
+			"             draw a background under the slides, which show it where they\n"
+			"             are transparent and around them; a linear gradient runs at\n"
+			"             DEGREES clockwise from left to right, -360..360, default 90, a\n"
+			"             cycle fades between the colors and back every SECONDS,\n"
+			"             0.1..3600, default 20\n"
+			"  -M MB      memory budget of the packed slide cache, default 64\n"
+			"             slides are /etc/boot/boot-NN.{png,apng,jpg,jpeg}, or animated as an APNG\n"
+			"             or a boot-NN.anim directory of frames with an optional 'delays' file\n"
+			"  -P PRIO    real-time mode: lock and prefault all memory, preload the first\n"
+			"             slide and run the event loop at SCHED_FIFO priority PRIO\n"
+			"  -j N       render workers besides the main thread, up to 7, default one per\n"
+			"             extra CPU\n"
+			"  -L N       start N, up to 32, stress(1) style CPU and memory workers to load\n"
+			"             the system\n"
+			"  -H         SIGUSR1 hands the last frame to the next DRM master, as '-c handoff'\n"
+			"             does, instead of terminating\n"
+			"  -s SOURCE  show raw frames read from SOURCE ('-' for stdin)\n"
+			"  -f FORMAT  pixel format of the stream, default xrgb8888\n"
+			"  -g WxH     frame size of the stream, up to 16384x16384, default the display\n"
+			"             mode\n"
+			"  -G WxH     write a test pattern stream to stdout\n"
+			"  -E WxH     write IMAGE fitted to WxH as a C header to stdout, packed or raw,\n"
+			"             for 'make EMBED=IMAGE' to build in as the splash shown while the\n"
+			"             first slide is missing\n"
+			"  card       DRM node to drive, default every /dev/dri/card* with an output\n"
+			"  -B         benchmark scanout formats, slide rotation, tile diffing, multi-head\n"
+			"             rendering and backgrounds (give -j first to size the pool), and\n"
+			"             decode-to-scanout time, slide cache packing and first frame\n"
+			"             time of images\n",
+			prog, prog, prog, prog, prog);
 }
 
 int main(int argc, char **argv)
 {
-	int ret, fd;
-	const char *card;
+	int ret, opt, fps, sig, len, stress = 0;
+	long major, minor, loop_major, loop_minor;
+	struct modeset_card *card;
+	struct modeset_device *iter;
+	const char *source = NULL;
 	struct epoll_event event;
+	uint32_t width, height;
+	unsigned long number;
 
-	if (argc > 1)
-		card = argv[1];
-	else
-		card = "/dev/dri/card0";
+	process_start_ns = get_process_start_ns();
+	if (argc > 2 && !strcmp(argv[1], "-c"))
+		return control_send(argc - 2, argv + 2);
+
+	while ((opt = getopt(argc, argv, "s:b:f:g:G:E:F:j:L:M:P:R:S:BHh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'B':
+			return bench_run(argc - optind, argv + optind);
+		case 'F':
+			if (parse_format_policy(optarg))
+			{
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'M':
+			if (parse_number(optarg, SIZE_MAX >> 20, &number) || !number)
+			{
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			slide_budget = (size_t)number << 20;
+			break;
+		case 'b':
+			if (parse_background(optarg))
+			{
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'R':
+			if (parse_rotation(optarg))
+			{
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'P':
+			rt_priority = atoi(optarg);
+			if (rt_priority < sched_get_priority_min(SCHED_FIFO) || rt_priority > sched_get_priority_max(SCHED_FIFO))
+			{
+				fprintf(stderr, "invalid SCHED_FIFO priority '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'L':
+			if (parse_number(optarg, STRESS_MAX, &number))
+			{
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			stress = number;
+			break;
+		case 'j':
+			if (parse_number(optarg, RENDER_THREADS_MAX, &number))
+			{
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			render_threads = number;
+			break;
+		case 'H':
+			handoff_on_usr1 = true;
+			break;
+		case 'S':
+			render_scale = atoi(optarg);
+			if (render_scale < 25 || render_scale > 100)
+			{
+				fprintf(stderr, "render scale must be 25..100 percent\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			source = optarg;
+			break;
+		case 'f':
+			if (!strcmp(optarg, "nv12"))
+				stream.format = DRM_FORMAT_NV12;
+			else if (!strcmp(optarg, "xrgb8888"))
+				stream.format = DRM_FORMAT_XRGB8888;
+			else
+			{
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'g':
+		case 'G':
+		case 'E':
+			len = 0;
+			if (sscanf(optarg, "%ux%u%n", &width, &height, &len) != 2 || optarg[len] || !width || !height ||
+				width > CTL_FRAME_DIM_MAX || height > CTL_FRAME_DIM_MAX)
+			{
+				fprintf(stderr, "invalid frame size '%s'\n", optarg);
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			if (opt == 'E')
+			{
+				if (optind >= argc)
+				{
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				return embed_generate(width, height, argv[optind],
+									  optind + 1 < argc && !strcmp(argv[optind + 1], "raw"));
+			}
+			if (opt == 'G')
+			{
+				fps = optind < argc ? atoi(argv[optind]) : 0;
+				return stream_generate(width, height, fps > 0 ? fps : 30);
+			}
+			stream.width = width;
+			stream.height = height;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
 
-	fprintf(stderr, "using card '%s'\n", card);
+	/* before anything is mapped, so all of it ends up locked */
+	if (rt_priority)
+		realtime_enter(rt_priority);
+
+	/* forked before any fd is opened, so workers hold no DRM master or socket */
+	stress_start(stress);
 
 	ret = catch_signals();
 	if (ret)
+	{
+		stress_stop();
 		return EXIT_FAILURE;
+	}
 
-	ret = modeset_open(&fd, card);
+	/* without a node every card with an output is driven */
+	ret = modeset_open_cards(optind < argc ? argv[optind] : NULL);
 	if (ret)
 		goto out_return;
 
-	ret = modeset_prepare(fd);
-	if (ret)
-		goto out_close;
+	/* page-flip and sequence events are delivered on each card's fd */
+	for (card = card_list; card; card = card->next)
+	{
+		event.events = EPOLLIN;
+		event.data.fd = card->fd;
+		if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, card->fd, &event) == -1) {
+			fprintf(stderr, "Failed to register drm fd: %d\n", card->fd);
+			ret = -errno;
+			goto out_cleanup;
+		}
+	}
+
+	if (control_open())
+		fprintf(stderr, "running without control socket\n");
+
+	if (source)
+	{
+		if (!stream.width)
+		{
+			stream.width = card_list->devices->bufs[0].width;
+			stream.height = card_list->devices->bufs[0].height;
+		}
+		ret = stream_open(source);
+		if (ret)
+			goto out_cleanup;
+	}
+
+	/* the first slide would otherwise be decoded on the frame that shows it */
+	if (rt_priority)
+	{
+		for (card = card_list; card; card = card->next)
+		{
+			for (iter = card->devices; iter; iter = iter->next)
+				slide_get(splash.slide, &iter->bufs[0], iter->sw_rotation);
+		}
+	}
 
-	modeset_draw(fd);
+	render_pool_start(render_threads);
+	modeset_draw();
+	rt_faults(&loop_major, &loop_minor);
 	
 	/* main loop SIGUSR1, SIGUSR2, SIGTERM exit loop */
 	while(1) { 
         if ((ret = epoll_pwait(fd_epoll, &event, 1, -1, (const __sigset_t*)&g_sigset_new)) < 0) {
             fprintf(stderr, "epoll_wait() failed. terminate with err: %d\n", errno);
             break;
+        }
+        /* a closing pipe reports EPOLLHUP, that only ends the stream */
+        if (stream.fd >= 0 && event.data.fd == stream.fd) {
+            stream_read(false);
+            if (!(event.events & EPOLLIN))
+                stream_close();
+            continue;
         }
 		if (check_event_flags(event.events)) {
 			break;
@@ -1047,20 +7495,43 @@ int main(int argc, char **argv)
 		}
         /* event on signalfd */
         if (event.data.fd == fd_signals) {
-            if (should_terminate(fd_signals))
+            sig = should_terminate(fd_signals);
+            if (sig == SIGUSR1 && handoff_on_usr1)
+                handoff_ready_ns = get_time_ns();
+            if (sig)
                 break;
             /* skip event */
             continue;
         }
+        /* commands from init scripts or the CarIOS main app */
+        if (event.data.fd == fd_control) {
+            if (control_dispatch())
+                break;
+            continue;
+        }
+        /* page-flip or vblank sequence event of one of the cards */
+        if (modeset_find_card(event.data.fd)) {
+            modeset_handle_events(event.data.fd);
+            continue;
+        }
 	}
 	
-	modeset_cleanup(fd);
 	ret = 0;
+	rt_faults(&major, &minor);
+	fprintf(stderr, "page faults while running: %ld major, %ld minor\n", major - loop_major, minor - loop_minor);
+
+out_cleanup:
+	render_pool_stop();
+	control_close();
+	/* the last frame stays up until the next master replaces it */
+	if (handoff_ready_ns)
+		modeset_handoff_cards();
+	modeset_cleanup_cards();
+	stream_free();
+	slide_cache_free();
 
-out_close:
-	close(fd);
-	
 out_return:
+	stress_stop();
 	close(fd_epoll);
 	if (ret)
 	{